@@ -25,6 +25,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 
@@ -64,6 +66,112 @@ static void *fallback_base_pages(size_t len, ghp_t flags)
 	return buf;
 }
 
+/*
+ * Hugetlb mappings cannot be MADV_WIPEONFORK, so those regions are kept
+ * from children with MADV_DONTFORK instead, and the child maps zero
+ * filled base pages in their place, which is what it would have seen.
+ */
+#define WIPE_REGIONS_MAX	64
+
+static struct {
+	pthread_mutex_t lock;
+	int handlers;
+	int nr;
+	struct {
+		void *addr;
+		size_t len;
+	} regions[WIPE_REGIONS_MAX];
+} wipe = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void wipe_prepare(void)
+{
+	pthread_mutex_lock(&wipe.lock);
+}
+
+static void wipe_parent(void)
+{
+	pthread_mutex_unlock(&wipe.lock);
+}
+
+/* Runs in the child of a possibly threaded parent, so no stdio here */
+static void wipe_child(void)
+{
+	int i;
+
+	for (i = 0; i < wipe.nr; i++)
+		mmap(wipe.regions[i].addr, wipe.regions[i].len,
+		     PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE, -1, 0);
+	pthread_mutex_unlock(&wipe.lock);
+}
+
+static int emulate_wipeonfork(void *addr, size_t len)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&wipe.lock);
+	if (wipe.nr == WIPE_REGIONS_MAX)
+		goto out;
+	if (!wipe.handlers) {
+		if (pthread_atfork(wipe_prepare, wipe_parent, wipe_child))
+			goto out;
+		wipe.handlers = 1;
+	}
+	if (hugetlbfs_madvise_hints(addr, len, HINT_DONTFORK))
+		goto out;
+
+	wipe.regions[wipe.nr].addr = addr;
+	wipe.regions[wipe.nr].len = len;
+	__atomic_store_n(&wipe.nr, wipe.nr + 1, __ATOMIC_RELAXED);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&wipe.lock);
+	return ret;
+}
+
+static void forget_wiped_region(void *ptr)
+{
+	int i;
+
+	if (!__atomic_load_n(&wipe.nr, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&wipe.lock);
+	for (i = 0; i < wipe.nr; i++) {
+		if ((char *)ptr < (char *)wipe.regions[i].addr ||
+		    (char *)ptr >= (char *)wipe.regions[i].addr +
+				   wipe.regions[i].len)
+			continue;
+		wipe.regions[i] = wipe.regions[wipe.nr - 1];
+		__atomic_store_n(&wipe.nr, wipe.nr - 1, __ATOMIC_RELAXED);
+		break;
+	}
+	pthread_mutex_unlock(&wipe.lock);
+}
+
+/* Apply the GHP_DONTFORK, GHP_WIPEONFORK and GHP_DONTDUMP flags */
+static void apply_region_hints(void *buf, size_t len, ghp_t flags)
+{
+	unsigned int hints = 0;
+
+	if (flags & GHP_DONTFORK)
+		hints |= HINT_DONTFORK;
+	else if (flags & GHP_WIPEONFORK)
+		hints |= HINT_WIPEONFORK;
+	if (flags & GHP_DONTDUMP)
+		hints |= HINT_DONTDUMP;
+	if (!hints)
+		return;
+
+	if ((hugetlbfs_madvise_hints(buf, len, hints) & HINT_WIPEONFORK) &&
+	    emulate_wipeonfork(buf, len))
+		WARNING("Region %p will not be wiped on fork\n", buf);
+}
+
+static int flush_deferred_frees(void);
+
 /**
  * get_huge_pages - Allocate an amount of memory backed by huge pages
  * len: Size of the region to allocate, must be hugepage-aligned
@@ -78,18 +186,42 @@ void *get_huge_pages(size_t len, ghp_t flags)
 {
 	void *buf;
 	int buf_fd = -1;
-	int mmap_reserve = __hugetlb_opts.no_reserve ? MAP_NORESERVE : 0;
+	int mmap_reserve;
 	int mmap_hugetlb = 0;
+	long budget;
+	int flushed = 0;
 	int ret;
 
+	hugetlbfs_lazy_init();
+	mmap_reserve = __hugetlb_opts.no_reserve ? MAP_NORESERVE : 0;
+
 	/* Catch an altogether-too easy typo */
 	if (flags & GHR_MASK)
 		ERROR("Improper use of GHR_* in get_huge_pages()\n");
 
+	/* Fail early rather than fault past the hugetlb cgroup limit */
+	budget = hugetlb_cgroup_budget(gethugepagesize());
+	if (budget >= 0 && (size_t)budget < len && flush_deferred_frees()) {
+		flushed = 1;
+		budget = hugetlb_cgroup_budget(gethugepagesize());
+	}
+	if (budget >= 0 && (size_t)budget < len) {
+		WARNING("get_huge_pages: hugetlb cgroup limit allows %ld more bytes, %zd requested\n",
+			budget, len);
+		errno = ENOMEM;
+		return NULL;
+	}
+
 #ifdef MAP_HUGETLB
 	mmap_hugetlb = MAP_HUGETLB;
 #endif
 
+	/*
+	 * Regions waiting for the reaper still hold their huge pages, so
+	 * if the pool runs dry free them here and try once more.
+	 */
+retry:
+	buf_fd = -1;
 	if (__hugetlb_opts.map_hugetlb &&
 			gethugepagesize() == kernel_default_hugepage_size()) {
 		/* Because we can use MAP_HUGETLB, we simply mmap the region */
@@ -113,6 +245,8 @@ void *get_huge_pages(size_t len, ghp_t flags)
 	if (buf == MAP_FAILED) {
 		if (buf_fd >= 0)
 			close(buf_fd);
+		if (errno == ENOMEM && !flushed++ && flush_deferred_frees())
+			goto retry;
 
 		WARNING("get_huge_pages: New region mapping failed (flags: 0x%lX): %s\n",
 			flags, strerror(errno));
@@ -125,6 +259,8 @@ void *get_huge_pages(size_t len, ghp_t flags)
 		munmap(buf, len);
 		if (buf_fd >= 0)
 			close(buf_fd);
+		if (!flushed++ && flush_deferred_frees())
+			goto retry;
 
 		WARNING("get_huge_pages: Prefaulting failed (flags: 0x%lX): %s\n",
 			flags, strerror(ret));
@@ -138,24 +274,50 @@ void *get_huge_pages(size_t len, ghp_t flags)
 		return NULL;
 	}
 
+	apply_region_hints(buf, len, flags);
+
 	/* woo, new buffer of shiny */
 	return buf;
 }
 
 #define MAPS_BUF_SZ 4096
-static void __free_huge_pages(void *ptr, int aligned)
+
+/* A region being freed, and what /proc/self/maps says it covers */
+struct free_region {
+	void *ptr;
+	int aligned;
+	unsigned long palign, hpalign;
+	unsigned long start, end;
+	unsigned long hpalign_end;
+};
+
+static int free_region_cmp(const void *a, const void *b)
+{
+	const struct free_region *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+/*
+ * Unmap a batch of regions.  /proc/self/maps is used to determine the
+ * length of each original allocation; it is read once for the whole
+ * batch, and regions that turn out to be adjacent are unmapped with a
+ * single munmap() so that the TLB is only flushed once for them.
+ */
+static void free_regions(struct free_region *regions, int nr)
 {
 	FILE *fd;
 	char line[MAPS_BUF_SZ];
 	unsigned long start = 0, end = 0;
-	unsigned long palign = 0, hpalign = 0;
-	unsigned long hpalign_end = 0;
+	int left = nr;
+	int i;
 
 	/*
-	 * /proc/self/maps is used to determine the length of the original
-	 * allocation. As mappings are based on different files, we can
-	 * assume that maps will not merge. If the hugepages were truly
-	 * anonymous, this assumption would be broken.
+	 * As mappings are based on different files, we can assume that
+	 * maps will not merge. If the hugepages were truly anonymous, this
+	 * assumption would be broken.
 	 */
 	fd = fopen("/proc/self/maps", "r");
 	if (!fd) {
@@ -167,68 +329,261 @@ static void __free_huge_pages(void *ptr, int aligned)
 	 * An unaligned address allocated by get_hugepage_region()
 	 * could be either page or hugepage aligned
 	 */
-	if (!aligned) {
-		palign = ALIGN_DOWN((unsigned long)ptr, getpagesize());
-		hpalign = ALIGN_DOWN((unsigned long)ptr, gethugepagesize());
+	for (i = 0; i < nr; i++) {
+		struct free_region *r = &regions[i];
+
+		r->start = r->end = r->hpalign_end = 0;
+		if (!r->aligned) {
+			r->palign = ALIGN_DOWN((unsigned long)r->ptr,
+					       getpagesize());
+			r->hpalign = ALIGN_DOWN((unsigned long)r->ptr,
+						gethugepagesize());
+		}
 	}
 
 	/* Parse /proc/maps for address ranges line by line */
-	while (!feof(fd)) {
+	while (left && fgets(line, MAPS_BUF_SZ, fd) != NULL) {
 		char *bufptr;
-		char *saveptr = NULL;
-
-		/* Read a line of input */
-		if (fgets(line, MAPS_BUF_SZ, fd) == NULL)
-			break;
 
 		/* Parse the line to get the start and end of each mapping */
-		bufptr = strtok_r(line, " ", &saveptr);
-		bufptr = strtok_r(bufptr, "-", &saveptr);
-		start = strtoull(bufptr, NULL, 16);
-		bufptr = strtok_r(NULL, "-", &saveptr);
-
-		/* If the correct mapping is found, remove it */
-		if (start == (unsigned long)ptr) {
-			end = strtoull(bufptr, NULL, 16);
-			munmap(ptr, end - start);
-			break;
+		start = strtoul(line, &bufptr, 16);
+		end = strtoul(bufptr + 1, NULL, 16);
+
+		for (i = 0; i < nr; i++) {
+			struct free_region *r = &regions[i];
+
+			if (r->end)
+				continue;
+
+			/* If the correct mapping is found, remove it */
+			if (start == (unsigned long)r->ptr) {
+				r->start = start;
+				r->end = end;
+				left--;
+				continue;
+			}
+
+			/* If the passed address is aligned, just move along */
+			if (r->aligned)
+				continue;
+
+			/*
+			 * If an address is hpage-aligned, record it but keep
+			 * looking. We might find a page-aligned or exact
+			 * address later
+			 */
+			if (start == r->hpalign) {
+				r->hpalign_end = end;
+				continue;
+			}
+
+			/* If an address is page-aligned, free it */
+			if (start == r->palign) {
+				r->start = start;
+				r->end = end;
+				left--;
+			}
 		}
+	}
+	fclose(fd);
 
-		/* If the passed address is aligned, just move along */
-		if (aligned)
-			continue;
+	/*
+	 * If no exact or page-aligned address was found, check for a
+	 * hpage-aligned address. If found, free it, otherwise warn that
+	 * the ptr pointed nowhere
+	 */
+	for (i = 0; i < nr; i++) {
+		struct free_region *r = &regions[i];
 
-		/*
-		 * If an address is hpage-aligned, record it but keep looking.
-		 * We might find a page-aligned or exact address later
-		 */
-		if (start == hpalign) {
-			hpalign_end = strtoull(bufptr, NULL, 16);
+		if (r->end)
+			continue;
+		if (r->hpalign_end == 0) {
+			ERROR("hugepages_free using invalid or double free\n");
 			continue;
 		}
+		r->start = r->hpalign;
+		r->end = r->hpalign_end;
+	}
 
-		/* If an address is page-aligned, free it */
-		if (start == palign) {
-			end = strtoull(bufptr, NULL, 16);
-			munmap((void *)start, end - start);
-			break;
+	/* Unmap, merging adjacent regions and dropping repeated frees */
+	if (nr > 1)
+		qsort(regions, nr, sizeof(*regions), free_region_cmp);
+	start = end = 0;
+	for (i = 0; i < nr; i++) {
+		if (!regions[i].end)
+			continue;
+		if (end && regions[i].start <= end) {
+			if (regions[i].end > end)
+				end = regions[i].end;
+			continue;
 		}
+		if (end)
+			munmap((void *)start, end - start);
+		start = regions[i].start;
+		end = regions[i].end;
+	}
+	if (end)
+		munmap((void *)start, end - start);
+}
 
+/*
+ * With HUGETLB_DEFERRED_FREE set, frees are queued for a reaper thread
+ * instead of being unmapped on the caller's thread.  The reaper handles
+ * them in batches once DEFERRED_FREE_BATCH are waiting or the oldest has
+ * waited for the configured delay, so the caller only pays for a queue
+ * push and the rest of the process sees far fewer TLB shootdowns.
+ */
+#define DEFERRED_FREE_MAX	512
+#define DEFERRED_FREE_BATCH	64
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int nr;
+	struct timespec deadline;
+	struct free_region queue[DEFERRED_FREE_MAX];
+} deferred = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *free_reaper(void *arg)
+{
+	static struct free_region batch[DEFERRED_FREE_MAX];
+	sigset_t set;
+	int nr;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&deferred.lock);
+	for (;;) {
+		while (deferred.nr == 0)
+			pthread_cond_wait(&deferred.cond, &deferred.lock);
+		while (deferred.nr < DEFERRED_FREE_BATCH &&
+		       pthread_cond_timedwait(&deferred.cond, &deferred.lock,
+					      &deferred.deadline) != ETIMEDOUT)
+			;
+
+		nr = deferred.nr;
+		memcpy(batch, deferred.queue, nr * sizeof(*batch));
+		deferred.nr = 0;
+
+		pthread_mutex_unlock(&deferred.lock);
+		DEBUG("Deferred free of %d region(s)\n", nr);
+		free_regions(batch, nr);
+		pthread_mutex_lock(&deferred.lock);
 	}
+	return NULL;
+}
 
-	/*
-	 * If no exact or page-aligned address was found, check for a
-	 * hpage-aligned address. If found, free it, otherwise warn that
-	 * the ptr pointed nowhere
-	 */
-	if (end == 0) {
-		if (hpalign_end == 0)
-			ERROR("hugepages_free using invalid or double free\n");
-		else
-			munmap((void *)hpalign, hpalign_end - hpalign);
+/*
+ * Free everything queued for the reaper on the caller's thread.  Returns
+ * the number of regions freed.
+ */
+static int flush_deferred_frees(void)
+{
+	int nr;
+
+	if (!__atomic_load_n(&deferred.nr, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&deferred.lock);
+	nr = deferred.nr;
+	if (nr) {
+		DEBUG("Flushing %d deferred free(s) for an allocation\n", nr);
+		free_regions(deferred.queue, nr);
+		deferred.nr = 0;
 	}
+	pthread_mutex_unlock(&deferred.lock);
+	return nr;
+}
 
-	fclose(fd);
+static void deferred_free_prepare(void)
+{
+	pthread_mutex_lock(&deferred.lock);
+}
+
+static void deferred_free_parent(void)
+{
+	pthread_mutex_unlock(&deferred.lock);
+}
+
+/* The reaper does not survive fork, the next free starts a new one */
+static void deferred_free_child(void)
+{
+	deferred.running = 0;
+	pthread_mutex_unlock(&deferred.lock);
+}
+
+/* Called with deferred.lock held */
+static int start_free_reaper(void)
+{
+	static int atfork_registered;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (!atfork_registered) {
+		pthread_atfork(deferred_free_prepare, deferred_free_parent,
+			       deferred_free_child);
+		atfork_registered = 1;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, free_reaper, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		WARNING("Unable to start deferred free thread: %s\n",
+			strerror(ret));
+		return -1;
+	}
+	deferred.running = 1;
+	return 0;
+}
+
+/* Queue a region for the reaper, returns -1 if it must be freed now */
+static int defer_free(void *ptr, int aligned)
+{
+	struct free_region *r;
+	unsigned long delay = __hugetlb_opts.deferred_free;
+
+	pthread_mutex_lock(&deferred.lock);
+	if ((!deferred.running && start_free_reaper()) ||
+	    deferred.nr == DEFERRED_FREE_MAX) {
+		pthread_mutex_unlock(&deferred.lock);
+		return -1;
+	}
+
+	if (deferred.nr == 0) {
+		clock_gettime(CLOCK_REALTIME, &deferred.deadline);
+		deferred.deadline.tv_sec += delay / 1000;
+		deferred.deadline.tv_nsec += (delay % 1000) * 1000000;
+		if (deferred.deadline.tv_nsec >= 1000000000) {
+			deferred.deadline.tv_sec++;
+			deferred.deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	r = &deferred.queue[deferred.nr++];
+	r->ptr = ptr;
+	r->aligned = aligned;
+	if (deferred.nr == 1 || deferred.nr == DEFERRED_FREE_BATCH)
+		pthread_cond_signal(&deferred.cond);
+	pthread_mutex_unlock(&deferred.lock);
+	return 0;
+}
+
+static void __free_huge_pages(void *ptr, int aligned)
+{
+	struct free_region region = { .ptr = ptr, .aligned = aligned };
+
+	forget_wiped_region(ptr);
+	if (__hugetlb_opts.deferred_free && !defer_free(ptr, aligned))
+		return;
+	free_regions(&region, 1);
 }
 
 /**
@@ -295,18 +650,28 @@ void *cachecolor(void *buf, size_t len, size_t color_bytes)
 void *get_hugepage_region(size_t len, ghr_t flags)
 {
 	size_t aligned_len, wastage;
+	ghp_t ghp_flags = GHP_DEFAULT;
 	void *buf;
 
 	/* Catch an altogether-too easy typo */
 	if (flags & GHP_MASK)
 		ERROR("Improper use of GHP_* in get_hugepage_region()\n");
 
+	if (flags & GHR_DONTFORK)
+		ghp_flags |= GHP_DONTFORK;
+	if (flags & GHR_WIPEONFORK)
+		ghp_flags |= GHP_WIPEONFORK;
+	if (flags & GHR_DONTDUMP)
+		ghp_flags |= GHP_DONTDUMP;
+
 	/* Align the len parameter to a hugepage boundary and allocate */
 	aligned_len = ALIGN(len, gethugepagesize());
-	buf = get_huge_pages(aligned_len, GHP_DEFAULT);
+	buf = get_huge_pages(aligned_len, ghp_flags);
 	if (buf == NULL && (flags & GHR_FALLBACK)) {
 		aligned_len = ALIGN(len, getpagesize());
 		buf = fallback_base_pages(len, flags);
+		if (buf)
+			apply_region_hints(buf, aligned_len, ghp_flags);
 	}
 
 	/* Calculate wastage for coloring */
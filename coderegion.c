@@ -0,0 +1,246 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Huge page backed regions for generated code.  elflink only puts the
+ * program's own text on huge pages; JIT compilers need somewhere to put
+ * the code they generate that does not cost an iTLB entry per 4kB.
+ *
+ * A region is one file mapped twice: a writable view that the code
+ * generator writes to and an executable view that the code is run
+ * from.  Neither view is both writable and executable, so W^X policies
+ * are respected, and both share the same huge pages.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "hugetlbfs.h"
+#include "libhugetlbfs_internal.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC	0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB	0x0004U
+#endif
+
+/* Sub-allocations are aligned to at least this much */
+#define CODE_ALIGN	16
+
+struct hugepage_code_region {
+	char *rw;
+	char *exec;
+	size_t len;
+	size_t used;
+};
+
+static int code_memfd(unsigned int flags)
+{
+#ifdef SYS_memfd_create
+	return syscall(SYS_memfd_create, "libhugetlbfs-code",
+		       MFD_CLOEXEC | flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Open a huge page backed file for a region, or -1 */
+static int code_hugepage_fd(void)
+{
+	if (hugetlbfs_test_feature(HUGETLB_FEATURE_MFD_HUGETLB) > 0 &&
+	    gethugepagesize() == kernel_default_hugepage_size()) {
+		int fd = code_memfd(MFD_HUGETLB);
+
+		if (fd >= 0)
+			return fd;
+	}
+	return hugetlbfs_unlinked_fd();
+}
+
+static int code_map_views(struct hugepage_code_region *region, int fd)
+{
+	if (ftruncate(fd, region->len) < 0)
+		return -1;
+
+	region->rw = mmap(NULL, region->len, PROT_READ|PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	if (region->rw == MAP_FAILED)
+		return -1;
+
+	region->exec = mmap(NULL, region->len, PROT_READ|PROT_EXEC,
+			    MAP_SHARED, fd, 0);
+	if (region->exec == MAP_FAILED) {
+		munmap(region->rw, region->len);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * get_hugepage_code_region - Allocate a region for generated code
+ * len: Size of the region in bytes
+ * flags: GHR_STRICT or GHR_FALLBACK, optionally with GHR_COLOR
+ *
+ * The region is backed by huge pages and mapped twice, once writable and
+ * once executable.  Code is placed in it with hugepage_code_alloc().  With
+ * GHR_FALLBACK, base pages are used if huge pages are not available.
+ * With GHR_COLOR, the first allocation starts at a cacheline within the
+ * space wasted by rounding len up, as get_hugepage_region() does.
+ */
+struct hugepage_code_region *get_hugepage_code_region(size_t len,
+						      ghr_t flags)
+{
+	struct hugepage_code_region *region;
+	long hpage_size = gethugepagesize();
+	int fd = -1;
+	int err;
+
+	/* The fork and dump hints are for get_hugepage_region() only */
+	if (flags & ~(GHR_STRICT|GHR_FALLBACK|GHR_COLOR)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	region = calloc(1, sizeof(*region));
+	if (!region)
+		return NULL;
+
+	if (hpage_size > 0) {
+		fd = code_hugepage_fd();
+		if (fd >= 0) {
+			region->len = ALIGN(len, hpage_size);
+			if (code_map_views(region, fd) == 0 &&
+			    hugetlbfs_prefault(region->rw, region->len) == 0)
+				goto out;
+			if (region->exec && region->exec != MAP_FAILED) {
+				munmap(region->rw, region->len);
+				munmap(region->exec, region->len);
+			}
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if (!(flags & GHR_FALLBACK)) {
+		WARNING("get_hugepage_code_region: no huge pages for %zd "
+			"bytes of code\n", len);
+		free(region);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Fall back to a shmem file on base pages */
+	DEBUG("get_hugepage_code_region: falling back to base pages\n");
+	region->rw = region->exec = NULL;
+	region->len = ALIGN(len, getpagesize());
+	fd = code_memfd(0);
+	if (fd < 0 || code_map_views(region, fd) < 0) {
+		err = errno;
+		if (fd >= 0)
+			close(fd);
+		free(region);
+		errno = err;
+		return NULL;
+	}
+
+out:
+	/* The mappings keep the file alive */
+	close(fd);
+
+	/* Only colour if requested */
+	if (flags & GHR_COLOR)
+		region->used = (char *)cachecolor(region->rw, len,
+						  region->len - len) - region->rw;
+	return region;
+}
+
+/**
+ * hugepage_code_alloc - Carve space for code out of a region
+ * region: Region from get_hugepage_code_region()
+ * len: Bytes of code
+ * align: Required alignment, a power of two; 0 for the default
+ * exec: Set to the executable address of the space
+ *
+ * Returns the writable address of the space, or NULL if the region is
+ * full.  Safe to call from several threads at once.
+ */
+void *hugepage_code_alloc(struct hugepage_code_region *region, size_t len,
+			  size_t align, void **exec)
+{
+	size_t used, start;
+
+	if (align < CODE_ALIGN)
+		align = CODE_ALIGN;
+	if (align & (align - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	used = __atomic_load_n(&region->used, __ATOMIC_RELAXED);
+	do {
+		start = ALIGN(used, align);
+		if (start > region->len || len > region->len - start) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&region->used, &used,
+					      start + len, 1, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	if (exec)
+		*exec = region->exec + start;
+	return region->rw + start;
+}
+
+/**
+ * hugepage_code_sync - Make newly written code visible for execution
+ * region: Region the code was written to
+ * exec: Executable address of the code
+ * len: Length of the code
+ *
+ * Must be called after writing code and before running it.  Where the
+ * data and instruction caches are not coherent (e.g. POWER and ARM)
+ * this writes back the data cache and invalidates the instruction cache
+ * for the executable view; elsewhere it is only a compiler barrier.
+ */
+void hugepage_code_sync(struct hugepage_code_region *region, void *exec,
+			size_t len)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	__builtin___clear_cache((char *)exec, (char *)exec + len);
+}
+
+/**
+ * free_hugepage_code_region - Unmap both views of a region
+ */
+void free_hugepage_code_region(struct hugepage_code_region *region)
+{
+	if (!region)
+		return;
+	munmap(region->rw, region->len);
+	munmap(region->exec, region->len);
+	free(region);
+}
@@ -0,0 +1,133 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Bulk copies that bypass the cache.  Remapping a large segment copies
+ * all of it once, at startup, and nothing reads the destination again
+ * through the cache soon after.  A plain memcpy pulls every destination
+ * line into the cache on the way, evicting the working set of whatever
+ * else shares it.  Non-temporal stores write around the cache instead.
+ *
+ * The variant is chosen once, on first use, from the CPU features.
+ * Architectures without a useful non-temporal store use memcpy.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_STREAM_COPY
+#endif
+
+#include "libhugetlbfs_internal.h"
+
+typedef void (*copy_fn)(void *dst, const void *src, size_t len);
+
+#ifdef HAVE_STREAM_COPY
+/*
+ * Both variants stream whole cache lines to a 64-byte aligned
+ * destination; the caller copies the unaligned head and tail.
+ */
+__attribute__((target("sse2")))
+static void stream_copy_sse2(void *dst, const void *src, size_t len)
+{
+	__m128i *d = dst;
+	const __m128i *s = src;
+
+	for (; len >= 64; len -= 64, d += 4, s += 4) {
+		__m128i a = _mm_loadu_si128(s);
+		__m128i b = _mm_loadu_si128(s + 1);
+		__m128i c = _mm_loadu_si128(s + 2);
+		__m128i e = _mm_loadu_si128(s + 3);
+
+		_mm_stream_si128(d, a);
+		_mm_stream_si128(d + 1, b);
+		_mm_stream_si128(d + 2, c);
+		_mm_stream_si128(d + 3, e);
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("avx")))
+static void stream_copy_avx(void *dst, const void *src, size_t len)
+{
+	__m256i *d = dst;
+	const __m256i *s = src;
+
+	for (; len >= 64; len -= 64, d += 2, s += 2) {
+		__m256i a = _mm256_loadu_si256(s);
+		__m256i b = _mm256_loadu_si256(s + 1);
+
+		_mm256_stream_si256(d, a);
+		_mm256_stream_si256(d + 1, b);
+	}
+	_mm_sfence();
+	_mm256_zeroupper();
+}
+
+static copy_fn select_stream_copy(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		return stream_copy_avx;
+	if (__builtin_cpu_supports("sse2"))
+		return stream_copy_sse2;
+	return NULL;
+}
+#else
+static copy_fn select_stream_copy(void)
+{
+	return NULL;
+}
+#endif
+
+static copy_fn stream_copy;
+static int stream_copy_selected;
+
+/**
+ * hugetlbfs_stream_copy - memcpy() that does not fill the cache
+ *
+ * The copy is complete and visible to other CPUs on return.  Only worth
+ * it for copies much larger than the cache that are not read back soon;
+ * see STREAM_COPY_MIN.
+ */
+void hugetlbfs_stream_copy(void *dst, const void *src, size_t len)
+{
+	size_t head;
+
+	if (!__atomic_load_n(&stream_copy_selected, __ATOMIC_ACQUIRE)) {
+		stream_copy = select_stream_copy();
+		__atomic_store_n(&stream_copy_selected, 1, __ATOMIC_RELEASE);
+	}
+
+	if (!stream_copy || len < 128) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	head = -(uintptr_t)dst & 63;
+	memcpy(dst, src, head);
+	dst = (char *)dst + head;
+	src = (const char *)src + head;
+	len -= head;
+
+	stream_copy(dst, src, len & ~63UL);
+	memcpy((char *)dst + (len & ~63UL), (const char *)src + (len & ~63UL),
+	       len & 63);
+}
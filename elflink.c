@@ -38,6 +38,13 @@
 #include <limits.h>
 #include <elf.h>
 #include <dlfcn.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "version.h"
 #include "hugetlbfs.h"
@@ -178,8 +185,22 @@ struct seg_layout {
 static struct seg_info htlb_seg_table[MAX_HTLB_SEGS];
 static int htlb_num_segs;
 static unsigned long force_remap; /* =0 */
+
+/* Set once the program's segments are on huge pages */
+static int segments_remapped;
+/* Set while hugetlbfs_remap_segments() runs, when other threads may exist */
+static int late_remap;
+static pthread_mutex_t late_remap_lock = PTHREAD_MUTEX_INITIALIZER;
 static long hpage_readonly_size, hpage_writable_size;
 
+/*
+ * Difference between the addresses the executable was linked at and the
+ * ones it was loaded at.  Zero for a fixed-address executable; for a PIE
+ * (or static-PIE) it is wherever the kernel put it.  Every p_vaddr and
+ * st_value must have this added before it is used as a pointer.
+ */
+static ElfW(Addr) load_bias;
+
 /**
  * assemble_path - handy wrapper around snprintf() for building paths
  * @dst: buffer of size PATH_MAX+1 to assemble string into
@@ -382,7 +403,7 @@ static int find_dynamic(Elf_Dyn **dyntab, const Elf_Phdr *phdr, int phnum)
 		++i;
 	}
 	if (phdr[i].p_type == PT_DYNAMIC) {
-		*dyntab = (Elf_Dyn *)phdr[i].p_vaddr;
+		*dyntab = (Elf_Dyn *)(load_bias + phdr[i].p_vaddr);
 		return 0;
 	} else {
 		DEBUG("No dynamic segment found\n");
@@ -390,15 +411,27 @@ static int find_dynamic(Elf_Dyn **dyntab, const Elf_Phdr *phdr, int phnum)
 	}
 }
 
+/*
+ * Address held in a dynamic entry.  ld.so normally relocates the address
+ * entries of the main program's .dynamic in place, but not where that
+ * section is read-only, so only add the bias to a value still below it.
+ */
+static void *dyn_ptr(const Elf_Dyn *dyn)
+{
+	if (load_bias && dyn->d_un.d_ptr < load_bias)
+		return (void *)(load_bias + dyn->d_un.d_ptr);
+	return (void *)dyn->d_un.d_ptr;
+}
+
 /* Find the dynamic string and symbol tables */
 static int find_tables(Elf_Dyn *dyntab, Elf_Sym **symtab, char **strtab)
 {
 	int i = 1;
 	while ((dyntab[i].d_tag != DT_NULL)) {
 		if (dyntab[i].d_tag == DT_SYMTAB)
-			*symtab = (Elf_Sym *)dyntab[i].d_un.d_ptr;
+			*symtab = dyn_ptr(&dyntab[i]);
 		else if (dyntab[i].d_tag == DT_STRTAB)
-			*strtab = (char *)dyntab[i].d_un.d_ptr;
+			*strtab = dyn_ptr(&dyntab[i]);
 		i++;
 	}
 
@@ -413,15 +446,67 @@ static int find_tables(Elf_Dyn *dyntab, Elf_Sym **symtab, char **strtab)
 	return 0;
 }
 
-/* Find the number of symbol table entries */
-static int find_numsyms(Elf_Sym *symtab, char *strtab)
+/*
+ * Count the symbols covered by a GNU hash table.  It does not record the
+ * count, but each bucket holds the index of the first symbol in its chain
+ * and the last symbol of a chain is marked, so the count is one past the
+ * end of the chain starting at the highest bucket.
+ */
+static int gnu_hash_numsyms(const Elf32_Word *gnu_hash, int *first)
+{
+	Elf32_Word nbuckets = gnu_hash[0];
+	Elf32_Word symoffset = gnu_hash[1];
+	Elf32_Word bloom_size = gnu_hash[2];
+	const Elf32_Word *buckets, *chain;
+	Elf32_Word i, last = 0;
+
+	buckets = (const Elf32_Word *)((const ElfW(Addr) *)&gnu_hash[4] +
+				       bloom_size);
+	chain = buckets + nbuckets;
+
+	for (i = 0; i < nbuckets; i++)
+		if (buckets[i] > last)
+			last = buckets[i];
+
+	/*
+	 * Symbols below symoffset are not hashed: they are the undefined
+	 * ones, which never have storage of their own in this object.
+	 */
+	*first = symoffset;
+	if (last < symoffset)
+		return symoffset;
+	while (!(chain[last - symoffset] & 1))
+		last++;
+	return last + 1;
+}
+
+/*
+ * Find the number of symbol table entries, and the first one that can be
+ * defined in this object
+ */
+static int find_numsyms(Elf_Dyn *dyntab, Elf_Sym *symtab, char *strtab,
+			int *first)
 {
+	Elf_Dyn *dyn;
+
+	*first = 0;
+
+	/* The SysV hash table has one chain entry per symbol */
+	for (dyn = dyntab; dyn->d_tag != DT_NULL; dyn++)
+		if (dyn->d_tag == DT_HASH)
+			return ((Elf32_Word *)dyn_ptr(dyn))[1];
+
+	for (dyn = dyntab; dyn->d_tag != DT_NULL; dyn++)
+		if (dyn->d_tag == DT_GNU_HASH)
+			return gnu_hash_numsyms(dyn_ptr(dyn), first);
+
 	/*
-	 * WARNING - The symbol table size calculation does not follow the ELF
-	 *           standard, but rather exploits an assumption we enforce in
-	 *           our linker scripts that the string table follows
-	 *           immediately after the symbol table. The linker scripts
-	 *           must maintain this assumption or this code will break.
+	 * WARNING - Without a hash table, the symbol table size calculation
+	 *           does not follow the ELF standard, but rather exploits an
+	 *           assumption we enforce in our linker scripts that the
+	 *           string table follows immediately after the symbol table.
+	 *           The linker scripts must maintain this assumption or this
+	 *           code will break.
 	 */
 	if ((void *)strtab <= (void *)symtab) {
 		DEBUG("Could not calculate dynamic symbol table size\n");
@@ -441,9 +526,13 @@ static int find_numsyms(Elf_Sym *symtab, char *strtab)
  */
 static inline int keep_symbol(char *strtab, Elf_Sym *s, void *start, void *end)
 {
-	if ((void *)s->st_value < start)
+	void *addr = (void *)(load_bias + s->st_value);
+
+	if (addr < start)
 		return 0;
-	if ((void *)s->st_value > end)
+	if (addr > end)
+		return 0;
+	if (s->st_shndx == SHN_UNDEF)
 		return 0;
 	if ((ELF_ST_BIND(s->st_info) != STB_GLOBAL) &&
 	    (ELF_ST_BIND(s->st_info) != STB_WEAK))
@@ -454,7 +543,7 @@ static inline int keep_symbol(char *strtab, Elf_Sym *s, void *start, void *end)
 		return 0;
 
 	if (__hugetlbfs_debug)
-		DEBUG("symbol to copy at %p: %s\n", (void *)s->st_value,
+		DEBUG("symbol to copy at %p: %s\n", addr,
 						strtab + s->st_name);
 
 	return 1;
@@ -479,7 +568,7 @@ static void get_extracopy(struct seg_info *seg, const Elf_Phdr *phdr, int phnum)
 	Elf_Sym *symtab = NULL; /* dynamic symbol table */
 	Elf_Sym *sym;           /* a symbol */
 	char *strtab = NULL;    /* string table for dynamic symbols */
-	int ret, numsyms, found_sym = 0;
+	int ret, numsyms, first, found_sym = 0;
 	void *start, *end, *end_orig;
 	void *sym_end;
 	void *plt_end;
@@ -501,7 +590,7 @@ static void get_extracopy(struct seg_info *seg, const Elf_Phdr *phdr, int phnum)
 	if (ret < 0)
 		goto bail;
 
-	numsyms = find_numsyms(symtab, strtab);
+	numsyms = find_numsyms(dyntab, symtab, strtab, &first);
 	if (numsyms < 0)
 		goto bail;
 
@@ -511,13 +600,13 @@ static void get_extracopy(struct seg_info *seg, const Elf_Phdr *phdr, int phnum)
 	 */
 	end = start;
 
-	for (sym = symtab; sym < symtab + numsyms; sym++) {
+	for (sym = symtab + first; sym < symtab + numsyms; sym++) {
 		if (!keep_symbol(strtab, sym, start, end_orig))
 			continue;
 
 		/* These are the droids we are looking for */
 		found_sym = 1;
-		sym_end = (void *)(sym->st_value + sym->st_size);
+		sym_end = (void *)(load_bias + sym->st_value + sym->st_size);
 		if (sym_end > end)
 			end = sym_end;
 	}
@@ -626,7 +715,7 @@ static int save_phdr(int table_idx, int phnum, const ElfW(Phdr) *phdr)
 	if (phdr->p_flags & PF_X)
 		prot |= PROT_EXEC;
 
-	htlb_seg_table[table_idx].vaddr = (void *) phdr->p_vaddr;
+	htlb_seg_table[table_idx].vaddr = (void *)(load_bias + phdr->p_vaddr);
 	htlb_seg_table[table_idx].filesz = phdr->p_filesz;
 	htlb_seg_table[table_idx].memsz = phdr->p_memsz;
 	htlb_seg_table[table_idx].prot = prot;
@@ -634,8 +723,8 @@ static int save_phdr(int table_idx, int phnum, const ElfW(Phdr) *phdr)
 
 	INFO("Segment %d (phdr %d): %#0lx-%#0lx  (filesz=%#0lx) "
 		"(prot = %#0x)\n", table_idx, phnum,
-		(unsigned long)  phdr->p_vaddr,
-		(unsigned long) phdr->p_vaddr + phdr->p_memsz,
+		(unsigned long) load_bias + phdr->p_vaddr,
+		(unsigned long) load_bias + phdr->p_vaddr + phdr->p_memsz,
 		(unsigned long) phdr->p_filesz, (unsigned int) prot);
 
 	return 0;
@@ -705,6 +794,10 @@ int parse_elf_normal(struct dl_phdr_info *info, size_t size, void *data)
 
 	page_size = getpagesize();
 	num_segs = 0;
+	load_bias = info->dlpi_addr;
+	if (load_bias)
+		INFO("Executable is position independent, loaded at %#0lx\n",
+		     (unsigned long)load_bias);
 
 	for (i = 0; i < info->dlpi_phnum; i++) {
 		if (info->dlpi_phdr[i].p_type != PT_LOAD)
@@ -717,6 +810,20 @@ int parse_elf_normal(struct dl_phdr_info *info, size_t size, void *data)
 		}
 
 		seg_psize = segment_requested_page_size(&info->dlpi_phdr[i]);
+		/*
+		 * The kernel only aligns a PIE's load address to the largest
+		 * p_align, so one not linked for huge pages (or run on an
+		 * older kernel) can land anywhere, and the remapped segment
+		 * would then no longer line up with its huge page.
+		 */
+		if (seg_psize != page_size && (load_bias & (seg_psize - 1))) {
+			WARNING("Executable loaded at %#0lx, which is not "
+				"aligned to %ld kB pages; relink with "
+				"ld.hugetlbfs --hugetlbfs-align\n",
+				(unsigned long)load_bias, seg_psize / 1024);
+			htlb_num_segs = 0;
+			return 1;
+		}
 		if (seg_psize != page_size) {
 			if (save_phdr(htlb_num_segs, i, &info->dlpi_phdr[i]))
 				return 1;
@@ -725,8 +832,9 @@ int parse_elf_normal(struct dl_phdr_info *info, size_t size, void *data)
 			htlb_seg_table[htlb_num_segs].page_size = seg_psize;
 			htlb_num_segs++;
 		}
-		start = ALIGN_DOWN(info->dlpi_phdr[i].p_vaddr, seg_psize);
-		end = ALIGN(info->dlpi_phdr[i].p_vaddr +
+		start = ALIGN_DOWN(load_bias + info->dlpi_phdr[i].p_vaddr,
+				seg_psize);
+		end = ALIGN(load_bias + info->dlpi_phdr[i].p_vaddr +
 				info->dlpi_phdr[i].p_memsz, seg_psize);
 
 		segments[num_segs].page_size = seg_psize;
@@ -758,6 +866,8 @@ int parse_elf_partial(struct dl_phdr_info *info, size_t size, void *data)
 	 * us the main program's phdrs on the first iteration, and
 	 * always return 1 to cease iteration at that point. */
 
+	load_bias = info->dlpi_addr;
+
 	for (i = 0; i < info->dlpi_phnum; i++) {
 		if (info->dlpi_phdr[i].p_type != PT_LOAD)
 			continue;
@@ -771,8 +881,9 @@ int parse_elf_partial(struct dl_phdr_info *info, size_t size, void *data)
 		 * in this forced way won't violate any contiguity
 		 * constraints.
 		 */
-		vaddr = hugetlb_next_slice_start(info->dlpi_phdr[i].p_vaddr);
-		gap = vaddr - info->dlpi_phdr[i].p_vaddr;
+		vaddr = hugetlb_next_slice_start(load_bias +
+						 info->dlpi_phdr[i].p_vaddr);
+		gap = vaddr - (load_bias + info->dlpi_phdr[i].p_vaddr);
 		slice_end = hugetlb_slice_end(vaddr);
 		/*
 		 * we should stop remapping just before the slice
@@ -833,6 +944,122 @@ static void check_range_empty(void *addr, unsigned long len)
 		munmap(p, len);
 }
 
+/*
+ * Is len bytes at p all zero?  len is a multiple of 64.  This runs over
+ * most of every remapped segment, so test a cache line at a time with the
+ * widest vectors the compiler is allowed to assume.
+ */
+static int is_zero_chunk(const void *p, unsigned long len)
+{
+	const char *c = p, *end = c + len;
+
+#if defined(__SSE2__)
+	for (; c < end; c += 64) {
+		__m128i v;
+
+		v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)c),
+				     _mm_loadu_si128((const __m128i *)(c + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(c + 32)),
+				     _mm_loadu_si128((const __m128i *)(c + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))
+		    != 0xffff)
+			return 0;
+	}
+#elif defined(__ARM_NEON)
+	for (; c < end; c += 64) {
+		uint8x16_t v;
+
+		v = vorrq_u8(vorrq_u8(vld1q_u8((const uint8_t *)c),
+				      vld1q_u8((const uint8_t *)(c + 16))),
+			     vorrq_u8(vld1q_u8((const uint8_t *)(c + 32)),
+				      vld1q_u8((const uint8_t *)(c + 48))));
+		if (vgetq_lane_u64(vreinterpretq_u64_u8(v), 0) |
+		    vgetq_lane_u64(vreinterpretq_u64_u8(v), 1))
+			return 0;
+	}
+#else
+	for (; c < end; c += 64) {
+		unsigned long acc = 0;
+		int i;
+
+		for (i = 0; i < 64; i += sizeof(unsigned long)) {
+			unsigned long w;
+
+			memcpy(&w, c + i, sizeof(w));
+			acc |= w;
+		}
+		if (acc)
+			return 0;
+	}
+#endif
+	return 1;
+}
+
+/* Copy a run of non-zero chunks, around the cache if it is large */
+static void copy_run(char *dst, const char *src, unsigned long len,
+		     int stream)
+{
+	if (!len)
+		return;
+	if (stream)
+		hugetlbfs_stream_copy(dst, src, len);
+	else
+		memcpy(dst, src, len);
+}
+
+/*
+ * Copy len bytes from src to the freshly created, zero-filled huge page
+ * mapping at dst, leaving out chunks that are zero in the source.  Chunks
+ * follow the base pages of the destination, so a huge page whose source
+ * is entirely zero is never written, and so never faulted in.  Runs of
+ * non-zero chunks within a huge page are copied in one go, around the
+ * cache for large segments.  Returns the number of huge pages left
+ * untouched.
+ */
+static unsigned long copy_nonzero(char *dst, const char *src,
+				  unsigned long len, long hpage_size)
+{
+	unsigned long chunk = getpagesize();
+	unsigned long skipped = 0, n, run;
+	char *hpage_end, *end = dst + len;
+	int stream = len >= STREAM_COPY_MIN;
+	int touched;
+
+	while (dst < end) {
+		hpage_end = (char *)ALIGN((unsigned long)dst + 1, hpage_size);
+		if (hpage_end > end)
+			hpage_end = end;
+		touched = 0;
+		run = 0;
+
+		while (dst + run < hpage_end) {
+			n = ALIGN((unsigned long)dst + run + 1, chunk) -
+				((unsigned long)dst + run);
+			if (n > hpage_end - (dst + run))
+				n = hpage_end - (dst + run);
+
+			if (n != chunk || !is_zero_chunk(src + run, n)) {
+				run += n;
+				touched = 1;
+				continue;
+			}
+
+			/* A zero chunk ends the run before it */
+			copy_run(dst, src, run, stream);
+			dst += run + n;
+			src += run + n;
+			run = 0;
+		}
+		copy_run(dst, src, run, stream);
+		dst += run;
+		src += run;
+		if (!touched)
+			skipped++;
+	}
+	return skipped;
+}
+
 /*
  * Copy a program segment into a huge page. If possible, try to copy the
  * smallest amount of data possible, unless the user disables this
@@ -841,7 +1068,7 @@ static void check_range_empty(void *addr, unsigned long len)
 static int prepare_segment(struct seg_info *seg)
 {
 	void *start, *p, *end, *new_end;
-	unsigned long size, offset;
+	unsigned long size, offset, skipped;
 	long page_size = getpagesize();
 	long hpage_size;
 	int mmap_reserve = __hugetlb_opts.no_reserve ? MAP_NORESERVE : 0;
@@ -893,12 +1120,20 @@ static int prepare_segment(struct seg_info *seg)
 	 * is known to be initialized already, extrasz will be non-zero and
 	 * that many addtional bytes will be copied from the beginning of the
 	 * memsz region.  The rest of the memsz is understood to be zeroes and
-	 * need not be copied.
+	 * need not be copied.  Zero pages within the copied range are skipped
+	 * as well, as the new mapping is already zero-filled.  That saves
+	 * their faults and copying; pool pages are only saved with
+	 * HUGETLB_NO_RESERVE, as otherwise the mapping above has already
+	 * reserved the whole file range.
 	 */
 	INFO("Mapped hugeseg at %p. Copying %#0lx bytes and %#0lx extra bytes"
 		" from %p...", p, seg->filesz, seg->extrasz, seg->vaddr);
-	memcpy(p + offset, seg->vaddr, seg->filesz + seg->extrasz);
+	skipped = copy_nonzero(p + offset, seg->vaddr,
+			       seg->filesz + seg->extrasz, hpage_size);
 	INFO_CONT("done\n");
+	if (skipped)
+		INFO("%lu huge page(s) of the segment were zero and left "
+		     "untouched\n", skipped);
 
 	munmap(p, size);
 
@@ -918,6 +1153,13 @@ static int fork_and_prepare_segment(struct seg_info *htlb_seg_info)
 {
 	int pid, ret, status;
 
+	/*
+	 * Other threads may hold locks a child would need, and the reason
+	 * for forking does not apply once the program is running.
+	 */
+	if (late_remap)
+		return prepare_segment(htlb_seg_info);
+
 	if ((pid = fork()) < 0) {
 		WARNING("fork failed");
 		return -1;
@@ -1163,6 +1405,14 @@ static void remap_segments(struct seg_info *seg, int num)
 	/* The segments are all back at this point.
 	 * and it should be safe to reference static data
 	 */
+	for (i = 0; i < num && __hugetlb_opts.segment_hints; i++) {
+		hpage_size = seg[i].page_size;
+		start = ALIGN_DOWN((unsigned long)seg[i].vaddr, hpage_size);
+		mapsize = ALIGN((unsigned long)seg[i].vaddr + seg[i].memsz,
+				hpage_size) - start;
+		hugetlbfs_madvise_hints((void *)start, mapsize,
+					__hugetlb_opts.segment_hints);
+	}
 }
 
 static int set_hpage_sizes(const char *env)
@@ -1296,6 +1546,9 @@ void hugetlbfs_setup_elflink(void)
 
 	INFO("libhugetlbfs version: %s\n", VERSION);
 
+	/* There are segments to remap, so mounts and features are needed */
+	hugetlbfs_lazy_init();
+
 	/* Do we need to find a share directory */
 	if (__hugetlb_opts.sharing) {
 		/*
@@ -1330,4 +1583,153 @@ void hugetlbfs_setup_elflink(void)
 
 	/* Step 3.  Unmap the old segments, map in the new ones */
 	remap_segments(htlb_seg_table, htlb_num_segs);
+	segments_remapped = 1;
+}
+
+/*
+ * Is every base page in a range unmapped?
+ */
+static int range_unmapped(unsigned long start, unsigned long end)
+{
+	long page_size = getpagesize();
+	unsigned char vec;
+
+	for (; start < end; start += page_size)
+		if (mincore((void *)start, page_size, &vec) == 0 ||
+		    errno != ENOMEM)
+			return 0;
+	return 1;
+}
+
+/*
+ * Swap one prepared segment in without ever leaving its range unmapped.
+ * The huge page copy is mapped and populated elsewhere first, then moved
+ * over the original with mremap(MREMAP_FIXED), which replaces the old
+ * mapping in a single step.  Kernels that cannot mremap() hugetlbfs
+ * mappings get the same effect, without the populated page tables, from
+ * an mmap(MAP_FIXED) over the original.
+ */
+static int swap_segment(struct seg_info *seg)
+{
+	long hpage_size = seg->page_size;
+	long page_size = getpagesize();
+	unsigned long start, end, mapsize;
+	int mmap_flags = MAP_PRIVATE|MAP_NORESERVE;
+	void *p;
+
+	start = ALIGN_DOWN((unsigned long)seg->vaddr, hpage_size);
+	end = ALIGN((unsigned long)seg->vaddr + seg->memsz, hpage_size);
+	mapsize = end - start;
+
+	/* The padding up to the huge page boundaries gets overwritten */
+	if (!range_unmapped(start, ALIGN_DOWN((unsigned long)seg->vaddr,
+					      page_size)) ||
+	    !range_unmapped(ALIGN((unsigned long)seg->vaddr + seg->memsz,
+				  page_size), end)) {
+		WARNING("Segment %p-%p shares its huge pages with other "
+			"mappings\n", seg->vaddr, seg->vaddr + seg->memsz);
+		errno = EBUSY;
+		return -1;
+	}
+
+	p = mmap(NULL, mapsize, seg->prot, mmap_flags|MAP_POPULATE,
+		 seg->fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	/* The hints move with the mapping */
+	hugetlbfs_madvise_hints(p, mapsize, __hugetlb_opts.segment_hints);
+
+	if (mremap(p, mapsize, mapsize, MREMAP_MAYMOVE|MREMAP_FIXED,
+		   (void *)start) == (void *)start)
+		return 0;
+	DEBUG("mremap() of segment failed (%s), mapping over it\n",
+	      strerror(errno));
+	munmap(p, mapsize);
+
+	p = mmap((void *)start, mapsize, seg->prot, mmap_flags|MAP_FIXED,
+		 seg->fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	hugetlbfs_madvise_hints(p, mapsize, __hugetlb_opts.segment_hints);
+	return 0;
+}
+
+/**
+ * hugetlbfs_remap_segments - Move program segments to huge pages at run time
+ * elfmap: Which segments, with the syntax of HUGETLB_ELFMAP
+ *
+ * Unlike remapping at startup, this is safe with other threads running:
+ * each segment is prepared in full and then swapped in atomically.
+ * Only read-only segments can be remapped this way, as writes to a
+ * writable segment between the copy and the swap would be lost.
+ */
+int hugetlbfs_remap_segments(const char *elfmap)
+{
+	int i, ret = -1, err = 0;
+
+	pthread_mutex_lock(&late_remap_lock);
+	if (segments_remapped) {
+		err = EALREADY;
+		goto out;
+	}
+
+	hpage_readonly_size = hpage_writable_size = 0;
+	if (!elfmap || set_hpage_sizes(elfmap)) {
+		err = EINVAL;
+		goto out;
+	}
+	if (hpage_writable_size) {
+		WARNING("Writable segments cannot be remapped after startup\n");
+		hpage_writable_size = 0;
+	}
+	if (!hpage_readonly_size) {
+		err = EINVAL;
+		goto out;
+	}
+
+	hugetlbfs_lazy_init();
+	if (__hugetlb_opts.sharing != 1)
+		__hugetlb_opts.sharing = 0;
+	if (__hugetlb_opts.sharing &&
+	    find_or_create_share_path(hpage_readonly_size)) {
+		err = errno;
+		goto out;
+	}
+
+	htlb_num_segs = 0;
+	if (parse_elf()) {
+		err = ENOENT;
+		goto out;
+	}
+
+	late_remap = 1;
+	for (i = 0; i < htlb_num_segs; i++) {
+		if (obtain_prepared_file(&htlb_seg_table[i]) < 0) {
+			err = errno ? errno : ENOMEM;
+			for (i--; i >= 0; i--)
+				close(htlb_seg_table[i].fd);
+			goto out;
+		}
+	}
+
+	/* Past the first swap there is no going back */
+	for (i = 0; i < htlb_num_segs; i++) {
+		if (swap_segment(&htlb_seg_table[i]) < 0) {
+			err = errno;
+			WARNING("Failed to remap segment %d: %s\n", i,
+				strerror(err));
+		}
+		close(htlb_seg_table[i].fd);
+	}
+	if (!err) {
+		segments_remapped = 1;
+		ret = 0;
+	}
+
+out:
+	late_remap = 0;
+	pthread_mutex_unlock(&late_remap_lock);
+	if (err)
+		errno = err;
+	return ret;
 }
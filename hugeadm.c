@@ -33,6 +33,11 @@
 #include <grp.h>
 #include <pwd.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -74,6 +79,12 @@ extern char *optarg;
 #define PROCSHMMAX "/proc/sys/kernel/shmmax"
 #define PROCHUGETLBGROUP "/proc/sys/vm/hugetlb_shm_group"
 #define PROCZONEINFO "/proc/zoneinfo"
+#define SYSNODEDIR "/sys/devices/system/node"
+#define PROCBUDDYINFO "/proc/buddyinfo"
+#define PROCPAGETYPEINFO "/proc/pagetypeinfo"
+#define PROCCOMPACTMEMORY "/proc/sys/vm/compact_memory"
+#define PROCDROPCACHES "/proc/sys/vm/drop_caches"
+#define MAX_NODES 1024
 #define FS_NAME "hugetlbfs"
 #define MIN_COL 20
 #define MAX_SIZE_MNTENT (64 + PATH_MAX + 32 + 128 + 2 * sizeof(int))
@@ -98,6 +109,8 @@ void print_usage()
 
 	OPTION("--list-all-mounts", "List all current hugetlbfs mount points");
 	OPTION("--pool-list", "List all pools");
+	OPTION("--pool-plan", "Forecast how many huge pages of each size");
+	CONT("can be allocated on each node now and after compaction");
 	OPTION("--hard", "specified with --pool-pages-min to make");
 	CONT("multiple attempts at adjusting the pool size to the");
 	CONT("specified count on failure");
@@ -146,6 +159,9 @@ void print_usage()
 	CONT("Creates a mount point for each available huge");
 	CONT("page size under /var/lib/hugetlbfs/global");
 	CONT("usable by anyone");
+	OPTION("--update-mount-cache", "Record the hugetlbfs mounts of this mount");
+	CONT("namespace in " HUGETLB_RUN_DIR " so that");
+	CONT("processes can skip scanning /proc/mounts");
 
 	OPTION("--max-size <size<G|M|K>>", "Limit the filesystem size of a new mount point");
 	OPTION("--max-inodes <number>", "Limit the number of inodes on a new mount point");
@@ -157,14 +173,36 @@ void print_usage()
 	CONT("the specified options would have done without");
 	CONT("taking any action");
 
+	OPTION("--cgroup-list", "List the hugetlb limits and usage of every");
+	CONT("cgroup v2 with the hugetlb controller enabled");
+	OPTION("--cgroup-limit <cgroup>:<size|DEFAULT>:<pagecount|memsize<G|M|K>|max>", "");
+	CONT("Set the hugetlb fault and reservation limits of a cgroup");
+	OPTION("--apply <file>", "Apply the pools, mounts, sysctls and");
+	CONT("transparent huge page settings declared in <file>,");
+	CONT("changing only what differs from the current state");
+	OPTION("--json", "Print --pool-list, --list-all-mounts, --page-sizes,");
+	CONT("--page-sizes-all, --explain and --watch output as JSON");
+	OPTION("--watch <seconds>", "Every <seconds>, print the allocation and");
+	CONT("free rates and the reservation and surplus changes of each pool");
 	OPTION("--explain", "Gives a overview of the status of the system");
 	CONT("with respect to huge page availability");
 
+	OPTION("--daemon[=<seconds>]", "Stay running and resize pools between");
+	CONT("their minimum and maximum as demand changes");
+	CONT("Pools are sampled every <seconds> (default 5)");
+	OPTION("--daemon-headroom <size|DEFAULT>:<pagecount|memsize<G|M|K>>", "");
+	CONT("Free, unreserved pages --daemon keeps in a pool");
+	OPTION("--daemon-idle <seconds>", "Time a pool must have excess free");
+	CONT("pages before --daemon shrinks it (default 60)");
+	OPTION("--daemon-rate <pagecount>", "Maximum pages --daemon adds to or");
+	CONT("removes from a pool per interval");
+
 	OPTION("--verbose <level>, -v", "Increases/sets tracing levels");
 	OPTION("--help, -h", "Prints this message");
 }
 
 int opt_dry_run = 0;
+int opt_json = 0;
 int opt_hard = 0;
 int opt_movable = -1;
 int opt_set_recommended_minfreekbytes = 0;
@@ -176,6 +214,8 @@ int opt_swap_persist = 0;
 int opt_obey_mempolicy = 0;
 unsigned long opt_limit_mount_size = 0;
 int opt_limit_mount_inodes = 0;
+int opt_daemon_idle = 60;
+long opt_daemon_rate = 0;
 int verbose_level = VERBOSITY_DEFAULT;
 char ramdisk_list[PATH_MAX] = "";
 
@@ -256,6 +296,7 @@ void verbose_expose(void)
 #define LONG_POOL_MIN_ADJ	(LONG_POOL|'m')
 #define LONG_POOL_MAX_ADJ	(LONG_POOL|'M')
 #define LONG_POOL_MEMPOL	(LONG_POOL|'p')
+#define LONG_POOL_PLAN		(LONG_POOL|'P')
 
 #define LONG_SET_RECOMMENDED_MINFREEKBYTES	('k' << 8)
 #define LONG_SET_RECOMMENDED_SHMMAX		('x' << 8)
@@ -281,6 +322,7 @@ void verbose_expose(void)
 #define LONG_CREATE_GROUP_MOUNTS	(LONG_MOUNTS|'g')
 #define LONG_CREATE_GLOBAL_MOUNTS	(LONG_MOUNTS|'G')
 #define LONG_LIST_ALL_MOUNTS		(LONG_MOUNTS|'A')
+#define LONG_UPDATE_MOUNT_CACHE		(LONG_MOUNTS|'c')
 
 #define LONG_LIMITS			('l' << 8)
 #define LONG_LIMIT_SIZE			(LONG_LIMITS|'S')
@@ -288,6 +330,15 @@ void verbose_expose(void)
 
 #define LONG_EXPLAIN	('e' << 8)
 
+#define LONG_APPLY	('a' << 8)
+
+#define LONG_JSON	('j' << 8)
+#define LONG_WATCH	('w' << 8)
+
+#define LONG_CGROUP		('c' << 8)
+#define LONG_CGROUP_LIST	(LONG_CGROUP|'l')
+#define LONG_CGROUP_LIMIT	(LONG_CGROUP|'L')
+
 #define LONG_TRANS			('t' << 8)
 #define LONG_TRANS_ALWAYS		(LONG_TRANS|'a')
 #define LONG_TRANS_MADVISE		(LONG_TRANS|'m')
@@ -298,6 +349,11 @@ void verbose_expose(void)
 #define LONG_KHUGE_SCAN			(LONG_KHUGE|'s')
 #define LONG_KHUGE_ALLOC		(LONG_KHUGE|'a')
 
+#define LONG_DAEMON			('D' << 8)
+#define LONG_DAEMON_HEADROOM		(LONG_DAEMON|'h')
+#define LONG_DAEMON_IDLE		(LONG_DAEMON|'i')
+#define LONG_DAEMON_RATE		(LONG_DAEMON|'r')
+
 #define MAX_POOLS	32
 
 static int cmpsizes(const void *p1, const void *p2)
@@ -306,6 +362,39 @@ static int cmpsizes(const void *p1, const void *p2)
 			((struct hpage_pool *)p2)->pagesize;
 }
 
+/*
+ * --json output is one JSON object per line for each listing requested,
+ * so a consumer can read the output of several options as JSON lines.
+ */
+static void json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
+
+static void json_pools(struct hpage_pool *pools, int cnt)
+{
+	int pos;
+
+	printf("[");
+	for (pos = 0; pos < cnt; pos++)
+		printf("%s{\"size\": %lu, \"minimum\": %lu, \"current\": %lu, "
+			"\"maximum\": %lu, \"default\": %s}",
+			pos ? ", " : "", pools[pos].pagesize,
+			pools[pos].minimum, pools[pos].size,
+			pools[pos].maximum,
+			pools[pos].is_default ? "true" : "false");
+	printf("]");
+}
+
 void pool_list(void)
 {
 	struct hpage_pool pools[MAX_POOLS];
@@ -319,6 +408,13 @@ void pool_list(void)
 	}
 	qsort(pools, cnt, sizeof(pools[0]), cmpsizes);
 
+	if (opt_json) {
+		printf("{\"pools\": ");
+		json_pools(pools, cnt);
+		printf("}\n");
+		return;
+	}
+
 	printf("%10s %8s %8s %8s %8s\n",
 		"Size", "Minimum", "Current", "Maximum", "Default");
 	for (pos = 0; cnt--; pos++) {
@@ -406,6 +502,23 @@ struct mount_list *collect_active_mounts(int *longest)
 	return NULL;
 }
 
+static void json_mounts(struct mount_list *current)
+{
+	int first = 1;
+
+	printf("[");
+	while (current) {
+		printf("%s{\"path\": ", first ? "" : ", ");
+		json_string(current->entry.mnt_dir);
+		printf(", \"options\": ");
+		json_string(current->entry.mnt_opts);
+		printf("}");
+		first = 0;
+		current = current->next;
+	}
+	printf("]");
+}
+
 void mounts_list_all(void)
 {
 	struct mount_list *list, *previous;
@@ -413,12 +526,15 @@ void mounts_list_all(void)
 
 	list = collect_active_mounts(&longest);
 
-	if (!list) {
+	if (opt_json) {
+		printf("{\"mounts\": ");
+		json_mounts(list);
+		printf("}\n");
+	} else if (!list) {
 		ERROR("No hugetlbfs mount points found\n");
 		return;
-	}
-
-	print_mounts(list, longest);
+	} else
+		print_mounts(list, longest);
 
 	while (list) {
 		previous = list;
@@ -1183,6 +1299,338 @@ static long value_adjust(char *adjust_str, long base, long page_size)
 }
 
 
+/*
+ * What the growth planner knows about one NUMA node for the page size
+ * being planned.  ready is the number of huge pages that can be allocated
+ * from free blocks right now; potential is the estimate after compaction,
+ * bounded by the free memory on the node and the memory in movable
+ * pageblocks that compaction can migrate.
+ */
+struct node_plan {
+	int node;
+	long ready;
+	long potential;
+	long memfree_kb;
+	long movable_kb;
+};
+
+struct growth_plan {
+	long page_size;
+	int nr_nodes;
+	long ready;
+	long potential;
+	struct node_plan nodes[MAX_NODES];
+};
+
+static struct node_plan *plan_node(struct growth_plan *plan, int node)
+{
+	struct node_plan *np;
+	int i;
+
+	for (i = 0; i < plan->nr_nodes; i++)
+		if (plan->nodes[i].node == node)
+			return &plan->nodes[i];
+
+	if (plan->nr_nodes == MAX_NODES)
+		return NULL;
+
+	np = &plan->nodes[plan->nr_nodes++];
+	memset(np, 0, sizeof(*np));
+	np->node = node;
+	np->movable_kb = -1;
+
+	return np;
+}
+
+#define PLAN_LINEBUF 1024
+
+/*
+ * Count the free blocks in /proc/buddyinfo that are at least as large as
+ * a huge page.  A free block of a higher order holds several huge pages.
+ */
+static void plan_read_buddyinfo(struct growth_plan *plan, int hp_order)
+{
+	FILE *f;
+	char buf[PLAN_LINEBUF];
+	struct node_plan *np;
+	char *p, *q;
+	int node, offset, order;
+	long count;
+
+	f = fopen(PROCBUDDYINFO, "r");
+	if (!f) {
+		WARNING("Unable to open " PROCBUDDYINFO "\n");
+		return;
+	}
+
+	while (fgets(buf, PLAN_LINEBUF, f)) {
+		offset = 0;
+		if (sscanf(buf, "Node %d, zone %*s%n", &node, &offset) != 1 ||
+		    !offset)
+			continue;
+
+		np = plan_node(plan, node);
+		if (!np)
+			continue;
+
+		p = buf + offset;
+		for (order = 0; ; order++, p = q) {
+			count = strtol(p, &q, 10);
+			if (q == p)
+				break;
+			if (order >= hp_order && order - hp_order < 32)
+				np->ready += count << (order - hp_order);
+		}
+	}
+	fclose(f);
+}
+
+/*
+ * Sum the movable pageblocks of each node from /proc/pagetypeinfo.  The
+ * file is only readable by root; without it the planner assumes all free
+ * memory on a node can be compacted.
+ */
+static void plan_read_pagetypeinfo(struct growth_plan *plan)
+{
+	FILE *f;
+	char buf[PLAN_LINEBUF];
+	struct node_plan *np;
+	long pages_per_block = 0;
+	long blocks;
+	char *tok, *iter, *p, *q;
+	int node, offset, column = -1, i;
+
+	f = fopen(PROCPAGETYPEINFO, "r");
+	if (!f) {
+		INFO("Unable to open " PROCPAGETYPEINFO ", assuming free "
+			"memory is compactable\n");
+		return;
+	}
+
+	while (fgets(buf, PLAN_LINEBUF, f)) {
+		if (sscanf(buf, "Pages per block: %ld", &pages_per_block) == 1)
+			continue;
+
+		if (strncmp(buf, "Number of blocks type", 21) == 0) {
+			column = -1;
+			iter = NULL;
+			tok = strtok_r(buf + 21, " \t\n", &iter);
+			for (i = 0; tok; i++) {
+				if (strcmp(tok, "Movable") == 0)
+					column = i;
+				tok = strtok_r(NULL, " \t\n", &iter);
+			}
+			continue;
+		}
+
+		if (column < 0 || !pages_per_block)
+			continue;
+
+		offset = 0;
+		if (sscanf(buf, "Node %d, zone %*s%n", &node, &offset) != 1 ||
+		    !offset)
+			continue;
+
+		p = buf + offset;
+		blocks = -1;
+		for (i = 0; i <= column; i++, p = q) {
+			blocks = strtol(p, &q, 10);
+			if (q == p) {
+				blocks = -1;
+				break;
+			}
+		}
+		if (blocks < 0)
+			continue;
+
+		np = plan_node(plan, node);
+		if (!np)
+			continue;
+		if (np->movable_kb < 0)
+			np->movable_kb = 0;
+		np->movable_kb += blocks * pages_per_block * (getpagesize() / 1024);
+	}
+	fclose(f);
+}
+
+/*
+ * Build the allocation forecast for one page size.
+ */
+void plan_pool_growth(long page_size, struct growth_plan *plan)
+{
+	char path[PATH_MAX];
+	struct node_plan *np;
+	long hp_kb = page_size / 1024;
+	long compactable;
+	int hp_order = 0;
+	int i;
+
+	while (((long)getpagesize() << hp_order) < page_size)
+		hp_order++;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->page_size = page_size;
+
+	plan_read_buddyinfo(plan, hp_order);
+	plan_read_pagetypeinfo(plan);
+
+	for (i = 0; i < plan->nr_nodes; i++) {
+		np = &plan->nodes[i];
+
+		snprintf(path, PATH_MAX, SYSNODEDIR "/node%d/meminfo", np->node);
+		if (access(path, R_OK) == 0)
+			np->memfree_kb = file_read_ulong(path, "MemFree:");
+		else
+			np->memfree_kb = read_meminfo("MemFree:");
+		if (np->memfree_kb < 0)
+			np->memfree_kb = 0;
+
+		compactable = np->memfree_kb;
+		if (np->movable_kb >= 0 && np->movable_kb < compactable)
+			compactable = np->movable_kb;
+		np->potential = compactable / hp_kb;
+		if (np->potential < np->ready)
+			np->potential = np->ready;
+
+		plan->ready += np->ready;
+		plan->potential += np->potential;
+	}
+}
+
+static void compact_node(int node)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, PATH_MAX, SYSNODEDIR "/node%d/compact", node);
+	if (access(path, W_OK))
+		snprintf(path, PATH_MAX, "%s", PROCCOMPACTMEMORY);
+
+	if (opt_dry_run) {
+		printf("echo 1 > %s\n", path);
+		return;
+	}
+
+	INFO("compacting node %d\n", node);
+	file_write_ulong(path, 1);
+}
+
+static void drop_page_cache(void)
+{
+	if (opt_dry_run) {
+		printf("echo 1 > %s\n", PROCDROPCACHES);
+		return;
+	}
+
+	INFO("dropping clean page cache\n");
+	sync();
+	file_write_ulong(PROCDROPCACHES, 1);
+}
+
+/*
+ * apply_config() prepares every pool size for growth once, before the
+ * sizes are resized in parallel, and the children use that forecast
+ * rather than dropping caches and compacting at the same time.
+ */
+static struct {
+	long page_size;
+	long expected;
+} planned_growth[MAX_POOLS];
+static int nr_planned_growth;
+
+/*
+ * Get the system ready to grow a pool by needed pages and return how
+ * many of them are expected to be allocatable.  Nodes are only compacted
+ * when the free blocks already there fall short, and only nodes that
+ * compaction is forecast to help.  The page cache is only dropped when
+ * compaction alone cannot cover the request.
+ */
+long prepare_pool_growth(long page_size, long needed)
+{
+	struct growth_plan *plan;
+	long expected;
+	int i, compacted = 0;
+
+	for (i = 0; i < nr_planned_growth; i++) {
+		if (planned_growth[i].page_size != page_size)
+			continue;
+		expected = planned_growth[i].expected;
+		return expected < needed ? expected : needed;
+	}
+
+	plan = malloc(sizeof(*plan));
+	if (!plan)
+		return needed;
+
+	plan_pool_growth(page_size, plan);
+	INFO("%ldkB pool: %ld pages needed, %ld ready, %ld after compaction\n",
+		page_size / 1024, needed, plan->ready, plan->potential);
+
+	if (plan->ready < needed) {
+		if (plan->potential < needed) {
+			drop_page_cache();
+			plan_pool_growth(page_size, plan);
+		}
+
+		for (i = 0; i < plan->nr_nodes; i++) {
+			if (plan->nodes[i].potential > plan->nodes[i].ready) {
+				compact_node(plan->nodes[i].node);
+				compacted = 1;
+			}
+		}
+
+		if (compacted && !opt_dry_run)
+			plan_pool_growth(page_size, plan);
+	}
+
+	expected = opt_dry_run ? plan->potential : plan->ready;
+	free(plan);
+
+	return expected < needed ? expected : needed;
+}
+
+void report_pool_growth(long page_size, long expected, long achieved)
+{
+	if (achieved < expected) {
+		WARNING("%ldkB pool grew by %ld pages, %ld were expected\n",
+			page_size / 1024, achieved, expected);
+	} else {
+		INFO("%ldkB pool grew by %ld pages, %ld were expected\n",
+			page_size / 1024, achieved, expected);
+	}
+}
+
+void pool_plan(void)
+{
+	struct hpage_pool pools[MAX_POOLS];
+	struct growth_plan *plan;
+	int pos, cnt, i;
+
+	cnt = hpool_sizes(pools, MAX_POOLS);
+	if (cnt < 0) {
+		ERROR("unable to obtain pools list");
+		exit(EXIT_FAILURE);
+	}
+	qsort(pools, cnt, sizeof(pools[0]), cmpsizes);
+
+	plan = malloc(sizeof(*plan));
+	if (!plan) {
+		ERROR("unable to allocate plan: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%10s %6s %10s %10s %12s\n",
+		"Size", "Node", "Ready", "Potential", "MemFree(kB)");
+	for (pos = 0; pos < cnt; pos++) {
+		plan_pool_growth(pools[pos].pagesize, plan);
+		for (i = 0; i < plan->nr_nodes; i++)
+			printf("%10ld %6d %10ld %10ld %12ld\n",
+				pools[pos].pagesize, plan->nodes[i].node,
+				plan->nodes[i].ready, plan->nodes[i].potential,
+				plan->nodes[i].memfree_kb);
+	}
+	free(plan);
+}
+
 void pool_adjust(char *cmd, unsigned int counter)
 {
 	struct hpage_pool pools[MAX_POOLS];
@@ -1198,6 +1646,9 @@ void pool_adjust(char *cmd, unsigned int counter)
 	unsigned long min_orig;
 	unsigned long max;
 	unsigned long last_pool_value;
+	unsigned long size_orig;
+	long needed = 0, expected = 0;
+	int swap_added = 0;
 
 	/* Extract the pagesize and adjustment. */
 	page_size_str = strtok_r(cmd, ":", &iter);
@@ -1262,12 +1713,23 @@ void pool_adjust(char *cmd, unsigned int counter)
 	else
 		cnt = -1;
 
-	if (min > min_orig) {
+	size_orig = pools[pos].size;
+	if (min > size_orig) {
+		needed = min - size_orig;
+		expected = prepare_pool_growth(page_size, needed);
+		if (expected < needed)
+			INFO("only %ld of %ld new pages expected to be "
+				"allocatable\n", expected, needed);
+	}
+
+	/* Swap only helps when compaction has not freed enough memory */
+	if (min > min_orig && expected < needed) {
 		if (opt_temp_swap)
 			add_temp_swap(page_size);
 		if (opt_ramdisk_swap)
 			add_ramdisk_swap(page_size);
 		check_swap();
+		swap_added = opt_temp_swap || opt_ramdisk_swap;
 	}
 
 	if (opt_obey_mempolicy && get_huge_page_counter(page_size,
@@ -1291,7 +1753,13 @@ void pool_adjust(char *cmd, unsigned int counter)
 			cnt--;
 		else
 			cnt = 5;
-		sleep(6);
+
+		/* Compact where it helps rather than waiting blindly */
+		if (prepare_pool_growth(page_size,
+				min - pools[pos].minimum) == 0)
+			sleep(6);
+		else
+			sleep(1);
 
 		last_pool_value = pools[pos].minimum;
 		INFO("Retrying allocation HUGEPAGES_TOTAL%s to %ld current %ld\n", opt_obey_mempolicy ? "_MEMPOL" : "", min, pools[pos].minimum);
@@ -1303,7 +1771,11 @@ void pool_adjust(char *cmd, unsigned int counter)
 		get_pool_size(page_size, &pools[pos]);
 	}
 
-	if (min > min_orig && !opt_swap_persist) {
+	if (needed)
+		report_pool_growth(page_size, expected,
+				   (long)(pools[pos].size - size_orig));
+
+	if (swap_added && !opt_swap_persist) {
 		if (opt_temp_swap)
 			rem_temp_swap();
 		else if (opt_ramdisk_swap)
@@ -1331,6 +1803,7 @@ void page_sizes(int all)
 	struct hpage_pool pools[MAX_POOLS];
 	int pos;
 	int cnt;
+	int first = 1;
 
 	cnt = hpool_sizes(pools, MAX_POOLS);
 	if (cnt < 0) {
@@ -1339,15 +1812,97 @@ void page_sizes(int all)
 	}
 	qsort(pools, cnt, sizeof(pools[0]), cmpsizes);
 
-	for (pos = 0; cnt--; pos++) {
-		if (all || (pools[pos].maximum &&
+	if (opt_json)
+		printf("{\"page_sizes\": [");
+	for (pos = 0; pos < cnt; pos++) {
+		if (!all && !(pools[pos].maximum &&
 		    hugetlbfs_find_path_for_size(pools[pos].pagesize)))
+			continue;
+		if (opt_json)
+			printf("%s%ld", first ? "" : ", ", pools[pos].pagesize);
+		else
 			printf("%ld\n", pools[pos].pagesize);
+		first = 0;
+	}
+	if (opt_json)
+		printf("]}\n");
+}
+
+/*
+ * The same report as explain(), as a single JSON object.  The advice
+ * printed by the checks is left to the consumer; the values it is based
+ * on are reported instead.
+ */
+void explain_json(void)
+{
+	struct hpage_pool pools[MAX_POOLS];
+	struct mount_list *list, *previous;
+	struct passwd *pwd;
+	struct group *grp;
+	gid_t gid;
+	int cnt, pos, first = 1;
+
+	cnt = hpool_sizes(pools, MAX_POOLS);
+	if (cnt < 0) {
+		ERROR("unable to obtain pools list");
+		exit(EXIT_FAILURE);
+	}
+	qsort(pools, cnt, sizeof(pools[0]), cmpsizes);
+
+	printf("{\"memory_total_kb\": %ld, ", read_meminfo(MEM_TOTAL));
+
+	list = collect_active_mounts(NULL);
+	printf("\"mounts\": ");
+	json_mounts(list);
+	while (list) {
+		previous = list;
+		list = list->next;
+		free(previous);
 	}
+
+	printf(", \"pools\": ");
+	json_pools(pools, cnt);
+
+	printf(", \"configured_page_sizes\": [");
+	for (pos = 0; pos < cnt; pos++) {
+		if (!pools[pos].maximum ||
+		    !hugetlbfs_find_path_for_size(pools[pos].pagesize))
+			continue;
+		printf("%s%ld", first ? "" : ", ", pools[pos].pagesize);
+		first = 0;
+	}
+	printf("]");
+
+	printf(", \"min_free_kbytes\": {\"current\": %ld, "
+		"\"recommended\": %ld}",
+		file_read_ulong(PROCMINFREEKBYTES, NULL),
+		recommended_minfreekbytes());
+	printf(", \"shmmax\": {\"current\": %ld, \"recommended\": %llu}",
+		file_read_ulong(PROCSHMMAX, NULL), recommended_shmmax());
+	printf(", \"swap\": {\"total_kb\": %ld, \"free_kb\": %ld}",
+		read_meminfo(SWAP_TOTAL), read_meminfo(SWAP_FREE));
+
+	gid = (gid_t)file_read_ulong(PROCHUGETLBGROUP, NULL);
+	grp = getgrgid(gid);
+	pwd = getpwuid(getuid());
+	printf(", \"hugetlb_shm_group\": {\"gid\": %d, \"name\": ", gid);
+	if (grp)
+		json_string(grp->gr_name);
+	else
+		printf("null");
+	printf(", \"user_is_member\": %s}}\n",
+		(grp && pwd && (gid == pwd->pw_gid || getuid() == 0 ||
+		 user_in_group(grp->gr_mem, pwd->pw_name))) ?
+		"true" : "false");
 }
 
 void explain()
 {
+	if (opt_json) {
+		explain_json();
+		return;
+	}
+
 	show_mem();
 	mounts_list_all();
 	printf("\nHuge page pools:\n");
@@ -1362,46 +1917,1328 @@ void explain()
 		"huge page pools are used.\n");
 }
 
-int main(int argc, char** argv)
+/*
+ * A consistent snapshot of the volatile counters of one pool.
+ */
+struct pool_sample {
+	long total;
+	long free;
+	long resv;
+	long surp;
+};
+
+/*
+ * Sample the counters of a pool until two consecutive reads agree, in the
+ * same way get_pool_size() does, so no decision is based on a torn set of
+ * values read while the kernel was allocating or freeing pages.
+ */
+void sample_pool(long page_size, struct pool_sample *sample)
 {
-	int ops;
-	int has_hugepages = kernel_has_hugepages();
+	struct pool_sample it = { -1, -1, -1, -1 };
 
-	char opts[] = "+hdv";
-	char base[PATH_MAX];
-	char *opt_min_adj[MAX_POOLS], *opt_max_adj[MAX_POOLS];
-	char *opt_user_mounts = NULL, *opt_group_mounts = NULL;
-	int opt_list_mounts = 0, opt_pool_list = 0, opt_create_mounts = 0;
-	int opt_global_mounts = 0, opt_pgsizes = 0, opt_pgsizes_all = 0;
-	int opt_explain = 0, minadj_count = 0, maxadj_count = 0;
-	int opt_trans_always = 0, opt_trans_never = 0, opt_trans_madvise = 0;
-	int opt_khuge_pages = 0, opt_khuge_scan = 0, opt_khuge_alloc = 0;
-	int ret = 0, index = 0;
-	char *khuge_pages = NULL, *khuge_alloc = NULL, *khuge_scan = NULL;
-	gid_t opt_gid = 0;
-	struct group *opt_grp = NULL;
-	int group_invalid = 0;
-	struct option long_opts[] = {
-		{"help",       no_argument, NULL, 'h'},
-		{"verbose",    required_argument, NULL, 'v' },
+	do {
+		*sample = it;
+		it.total = get_huge_page_counter(page_size, HUGEPAGES_TOTAL);
+		it.free = get_huge_page_counter(page_size, HUGEPAGES_FREE);
+		it.resv = get_huge_page_counter(page_size, HUGEPAGES_RSVD);
+		it.surp = get_huge_page_counter(page_size, HUGEPAGES_SURP);
+	} while (memcmp(sample, &it, sizeof(it)));
+
+	if (sample->total < 0)
+		sample->total = 0;
+	if (sample->free < 0)
+		sample->free = 0;
+	if (sample->resv < 0)
+		sample->resv = 0;
+	if (sample->surp < 0)
+		sample->surp = 0;
+}
 
-		{"list-all-mounts", no_argument, NULL, LONG_LIST_ALL_MOUNTS},
-		{"pool-list", no_argument, NULL, LONG_POOL_LIST},
-		{"pool-pages-min", required_argument, NULL, LONG_POOL_MIN_ADJ},
-		{"pool-pages-max", required_argument, NULL, LONG_POOL_MAX_ADJ},
-		{"obey-mempolicy", no_argument, NULL, LONG_POOL_MEMPOL},
-		{"thp-always", no_argument, NULL, LONG_TRANS_ALWAYS},
-		{"thp-madvise", no_argument, NULL, LONG_TRANS_MADVISE},
-		{"thp-never", no_argument, NULL, LONG_TRANS_NEVER},
-		{"thp-khugepaged-pages", required_argument, NULL, LONG_KHUGE_PAGES},
-		{"thp-khugepaged-scan-sleep", required_argument, NULL, LONG_KHUGE_SCAN},
-		{"thp-khugepaged-alloc-sleep", required_argument, NULL, LONG_KHUGE_ALLOC},
-		{"set-recommended-min_free_kbytes", no_argument, NULL, LONG_SET_RECOMMENDED_MINFREEKBYTES},
-		{"set-recommended-shmmax", no_argument, NULL, LONG_SET_RECOMMENDED_SHMMAX},
-		{"set-shm-group", required_argument, NULL, LONG_SET_HUGETLB_SHM_GROUP},
-		{"enable-zone-movable", no_argument, NULL, LONG_MOVABLE_ENABLE},
-		{"disable-zone-movable", no_argument, NULL, LONG_MOVABLE_DISABLE},
-		{"hard", no_argument, NULL, LONG_HARD},
+/*
+ * Fill nodes with the ids of the online NUMA nodes exposing per-node huge
+ * page counters.  Returns the number of nodes found, 0 if the kernel has
+ * no per-node pools.
+ */
+int find_nodes(int *nodes, int max)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char path[PATH_MAX];
+	int nr = 0;
+
+	dir = opendir(SYSNODEDIR);
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir)) && nr < max) {
+		if (strncmp(entry->d_name, "node", 4) != 0 ||
+		    !isdigit(entry->d_name[4]))
+			continue;
+		snprintf(path, PATH_MAX, SYSNODEDIR "/%s/hugepages",
+			entry->d_name);
+		if (access(path, R_OK))
+			continue;
+		nodes[nr++] = atoi(entry->d_name + 4);
+	}
+	closedir(dir);
+
+	return nr;
+}
+
+void node_counter_path(char *path, int node, long page_size,
+			const char *counter)
+{
+	snprintf(path, PATH_MAX,
+		SYSNODEDIR "/node%d/hugepages/hugepages-%lukB/%s",
+		node, page_size / 1024, counter);
+}
+
+long read_node_counter(int node, long page_size, const char *counter)
+{
+	char path[PATH_MAX];
+
+	node_counter_path(path, node, page_size, counter);
+	if (access(path, R_OK))
+		return -1;
+
+	return file_read_ulong(path, NULL);
+}
+
+/*
+ * Parse a "<size|DEFAULT>:<pagecount|memsize<G|M|K>>" specification into
+ * a page size and an absolute page count.
+ */
+void parse_pool_spec(char *spec, long *page_size, long *count)
+{
+	char *iter = NULL;
+	char *page_size_str;
+	char *count_str = NULL;
+
+	page_size_str = strtok_r(spec, ":", &iter);
+	if (page_size_str)
+		count_str = strtok_r(NULL, ":", &iter);
+
+	if (!page_size_str || !count_str) {
+		ERROR("%s: invalid pool specification\n", spec);
+		exit(EXIT_FAILURE);
+	}
+
+	if (strcmp(page_size_str, "DEFAULT") == 0)
+		*page_size = kernel_default_hugepage_size();
+	else
+		*page_size = parse_page_size(page_size_str);
+
+	if (*page_size <= 0) {
+		ERROR("%s: invalid page size\n", page_size_str);
+		exit(EXIT_FAILURE);
+	}
+
+	*count = value_adjust(count_str, 0, *page_size);
+}
+
+/*
+ * State kept by --daemon for each pool it manages.  The pool is never
+ * shrunk below floor nor grown above ceiling, which are the pool minimum
+ * and maximum at the time the daemon started.
+ */
+struct managed_pool {
+	long page_size;
+	long floor;
+	long ceiling;
+	long headroom;
+	long rate;
+	time_t idle_since;
+};
+
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+#define DAEMON_LOG(format, ...) syslog(LOG_INFO, format, ##__VA_ARGS__)
+
+/*
+ * Pick the node to resize.  Growth goes to the node with the fewest free
+ * huge pages, as that is where demand is; shrinking takes from the node
+ * with the most.  Returns -1 if there are no per-node counters.
+ */
+int pick_node(int *nodes, int nr_nodes, long page_size, int grow)
+{
+	int i, best = -1;
+	long best_free = 0;
+
+	for (i = 0; i < nr_nodes; i++) {
+		long nr_free = read_node_counter(nodes[i], page_size,
+							"free_hugepages");
+		if (nr_free < 0)
+			continue;
+		if (best == -1 || (grow && nr_free < best_free) ||
+		    (!grow && nr_free > best_free)) {
+			best = nodes[i];
+			best_free = nr_free;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Move the static size of a pool by delta pages, on one node if the
+ * kernel exposes per-node pools.  The overcommit limit is adjusted so
+ * that the pool maximum stays at the ceiling.
+ */
+void resize_managed_pool(struct managed_pool *mp, long nr_static, long delta,
+				int *nodes, int nr_nodes)
+{
+	char path[PATH_MAX];
+	long target = nr_static + delta;
+	long node_nr = 0;
+	int node;
+
+	node = pick_node(nodes, nr_nodes, mp->page_size, delta > 0);
+	if (node >= 0) {
+		node_nr = read_node_counter(node, mp->page_size,
+						"nr_hugepages");
+		if (node_nr < 0 || node_nr + delta < 0)
+			node = -1;
+	}
+
+	DAEMON_LOG("%s %ldkB pool by %ld pages to %ld (node %d)\n",
+		delta > 0 ? "growing" : "shrinking", mp->page_size / 1024,
+		delta > 0 ? delta : -delta, target, node);
+
+	if (opt_dry_run)
+		return;
+
+	/* Raise the overcommit limit before handing pages back */
+	if (delta < 0 && kernel_has_overcommit())
+		set_nr_overcommit_hugepages(mp->page_size,
+						mp->ceiling - target);
+
+	if (node >= 0) {
+		node_counter_path(path, node, mp->page_size, "nr_hugepages");
+		file_write_ulong(path, node_nr + delta);
+	} else
+		set_nr_hugepages(mp->page_size, target);
+
+	/* The kernel may have given us fewer pages than we asked for */
+	if (delta > 0 && kernel_has_overcommit()) {
+		struct pool_sample sample;
+
+		sample_pool(mp->page_size, &sample);
+		nr_static = sample.total - sample.surp;
+		if (nr_static < target)
+			DAEMON_LOG("%ldkB pool only reached %ld of %ld pages\n",
+				mp->page_size / 1024, nr_static, target);
+		set_nr_overcommit_hugepages(mp->page_size,
+			mp->ceiling > nr_static ? mp->ceiling - nr_static : 0);
+	}
+}
+
+/*
+ * One decision for one pool.  The static pool should cover every page
+ * in use or reserved plus the headroom.  Shortfalls are corrected at
+ * once, subject to the rate limit; excess is only released after it has
+ * persisted for the idle period, which gives the hysteresis that stops
+ * the pool flapping under a bursty load.
+ */
+void manage_pool(struct managed_pool *mp, int *nodes, int nr_nodes)
+{
+	struct pool_sample sample;
+	long nr_static, committed, delta;
+	time_t now = time(NULL);
+
+	sample_pool(mp->page_size, &sample);
+	nr_static = sample.total - sample.surp;
+	committed = (sample.total - sample.free) + sample.resv;
+	delta = committed + mp->headroom - nr_static;
+
+	DEBUG("%ldkB pool: total %ld free %ld resv %ld surp %ld\n",
+		mp->page_size / 1024, sample.total, sample.free, sample.resv,
+		sample.surp);
+
+	if (delta > 0) {
+		mp->idle_since = 0;
+		if (delta > mp->rate)
+			delta = mp->rate;
+		if (nr_static + delta > mp->ceiling)
+			delta = mp->ceiling - nr_static;
+		if (delta > 0)
+			resize_managed_pool(mp, nr_static, delta,
+						nodes, nr_nodes);
+		return;
+	}
+
+	/* The excess over what is committed plus the headroom */
+	delta = -delta;
+	if (delta <= 0 || nr_static <= mp->floor) {
+		mp->idle_since = 0;
+		return;
+	}
+
+	if (!mp->idle_since) {
+		mp->idle_since = now;
+		return;
+	}
+	if (now - mp->idle_since < opt_daemon_idle)
+		return;
+
+	/* Release the excess, keeping the headroom */
+	if (delta > mp->rate)
+		delta = mp->rate;
+	if (nr_static - delta < mp->floor)
+		delta = nr_static - mp->floor;
+	if (delta > 0)
+		resize_managed_pool(mp, nr_static, -delta, nodes, nr_nodes);
+}
+
+void pool_daemon(int interval, char **headroom, int headroom_count)
+{
+	struct hpage_pool pools[MAX_POOLS];
+	struct managed_pool managed[MAX_POOLS];
+	int nodes[MAX_NODES];
+	int nr_nodes, nr_managed = 0;
+	int pos, cnt, i;
+	long page_size, count;
+
+	if (geteuid() != 0 && !opt_dry_run) {
+		ERROR("Pools can only be managed by root\n");
+		exit(EXIT_FAILURE);
+	}
+
+	cnt = hpool_sizes(pools, MAX_POOLS);
+	if (cnt < 0) {
+		ERROR("unable to obtain pools list");
+		exit(EXIT_FAILURE);
+	}
+
+	for (pos = 0; pos < cnt; pos++) {
+		struct managed_pool *mp = &managed[nr_managed];
+
+		if (pools[pos].maximum <= pools[pos].minimum) {
+			INFO("%ldkB pool has no room between its minimum and "
+				"maximum, not managing it\n",
+				pools[pos].pagesize / 1024);
+			continue;
+		}
+
+		mp->page_size = pools[pos].pagesize;
+		mp->floor = pools[pos].minimum;
+		mp->ceiling = pools[pos].maximum;
+		mp->headroom = 0;
+		mp->rate = opt_daemon_rate;
+		if (mp->rate <= 0)
+			mp->rate = (mp->ceiling - mp->floor + 7) / 8;
+		mp->idle_since = 0;
+		nr_managed++;
+	}
+
+	for (i = 0; i < headroom_count; i++) {
+		parse_pool_spec(headroom[i], &page_size, &count);
+		for (pos = 0; pos < nr_managed; pos++)
+			if (managed[pos].page_size == page_size)
+				break;
+		if (pos == nr_managed) {
+			WARNING("%ldkB pool is not managed, ignoring its "
+				"headroom\n", page_size / 1024);
+			continue;
+		}
+		managed[pos].headroom = count;
+	}
+
+	if (nr_managed == 0) {
+		ERROR("No pools to manage, use --pool-pages-max to set a "
+			"maximum above the minimum\n");
+		exit(EXIT_FAILURE);
+	}
+
+	nr_nodes = find_nodes(nodes, MAX_NODES);
+
+	openlog("hugeadm", LOG_PID | LOG_PERROR, LOG_DAEMON);
+	for (pos = 0; pos < nr_managed; pos++)
+		DAEMON_LOG("managing %ldkB pool between %ld and %ld pages, "
+			"headroom %ld, rate %ld\n",
+			managed[pos].page_size / 1024, managed[pos].floor,
+			managed[pos].ceiling, managed[pos].headroom,
+			managed[pos].rate);
+
+	signal(SIGTERM, daemon_signal);
+	signal(SIGINT, daemon_signal);
+	signal(SIGHUP, daemon_signal);
+
+	while (!daemon_stop) {
+		for (pos = 0; pos < nr_managed; pos++)
+			manage_pool(&managed[pos], nodes, nr_nodes);
+		sleep(interval);
+	}
+
+	DAEMON_LOG("exiting\n");
+	closelog();
+}
+
+/*
+ * Stream the change in every pool each interval.  The counters only give
+ * the net change, so pages allocated and freed within one interval are
+ * not seen; the reported rates are lower bounds on the real churn.
+ */
+void pool_watch(int interval)
+{
+	struct hpage_pool pools[MAX_POOLS];
+	struct pool_sample last[MAX_POOLS], now;
+	struct timespec then, ts;
+	double elapsed, alloc_rate, free_rate;
+	long used;
+	int pos, cnt;
+
+	cnt = hpool_sizes(pools, MAX_POOLS);
+	if (cnt < 0) {
+		ERROR("unable to obtain pools list");
+		exit(EXIT_FAILURE);
+	}
+	qsort(pools, cnt, sizeof(pools[0]), cmpsizes);
+
+	for (pos = 0; pos < cnt; pos++)
+		sample_pool(pools[pos].pagesize, &last[pos]);
+	clock_gettime(CLOCK_MONOTONIC, &then);
+
+	signal(SIGTERM, daemon_signal);
+	signal(SIGINT, daemon_signal);
+
+	if (!opt_json)
+		printf("%10s %10s %8s %8s %8s %8s %10s %10s %8s %8s\n",
+			"Time", "Size", "Total", "Free", "Resv", "Surp",
+			"Alloc/s", "Free/s", "ResvDlt", "SurpDlt");
+
+	while (!daemon_stop) {
+		sleep(interval);
+		if (daemon_stop)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		elapsed = (ts.tv_sec - then.tv_sec) +
+			(ts.tv_nsec - then.tv_nsec) / 1e9;
+		then = ts;
+		if (elapsed <= 0)
+			continue;
+
+		if (opt_json)
+			printf("{\"time\": %ld, \"pools\": [", (long)time(NULL));
+
+		for (pos = 0; pos < cnt; pos++) {
+			sample_pool(pools[pos].pagesize, &now);
+
+			used = (now.total - now.free) -
+				(last[pos].total - last[pos].free);
+			alloc_rate = used > 0 ? used / elapsed : 0;
+			free_rate = used < 0 ? -used / elapsed : 0;
+
+			if (opt_json)
+				printf("%s{\"size\": %lu, \"total\": %ld, "
+					"\"free\": %ld, \"resv\": %ld, "
+					"\"surp\": %ld, \"alloc_rate\": %.2f, "
+					"\"free_rate\": %.2f, "
+					"\"resv_delta\": %ld, "
+					"\"surp_delta\": %ld}",
+					pos ? ", " : "", pools[pos].pagesize,
+					now.total, now.free, now.resv,
+					now.surp, alloc_rate, free_rate,
+					now.resv - last[pos].resv,
+					now.surp - last[pos].surp);
+			else
+				printf("%10ld %10lu %8ld %8ld %8ld %8ld "
+					"%10.2f %10.2f %8ld %8ld\n",
+					(long)time(NULL), pools[pos].pagesize,
+					now.total, now.free, now.resv,
+					now.surp, alloc_rate, free_rate,
+					now.resv - last[pos].resv,
+					now.surp - last[pos].surp);
+
+			last[pos] = now;
+		}
+
+		if (opt_json)
+			printf("]}\n");
+		fflush(stdout);
+	}
+}
+
+/*
+ * Print the hugetlb limits and usage of every cgroup below dir that has
+ * the hugetlb controller enabled, one line per page size.
+ */
+static void cgroup_list_dir(const char *root, const char *dir,
+				struct hpage_pool *pools, int cnt)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	const char *name;
+	DIR *d;
+	int pos;
+
+	for (pos = 0; pos < cnt; pos++) {
+		long limit, usage, rsvd_limit, rsvd_usage;
+
+		limit = hugetlb_cgroup_read(dir, pools[pos].pagesize, "max");
+		if (limit == -2)
+			break;
+		usage = hugetlb_cgroup_read(dir, pools[pos].pagesize,
+						"current");
+		rsvd_limit = hugetlb_cgroup_read(dir, pools[pos].pagesize,
+						"rsvd.max");
+		rsvd_usage = hugetlb_cgroup_read(dir, pools[pos].pagesize,
+						"rsvd.current");
+
+		name = dir + strlen(root);
+		printf("%-40s %10ld ", *name ? name : "/", pools[pos].pagesize);
+		if (limit == -1)
+			printf("%14s ", "max");
+		else
+			printf("%14ld ", limit);
+		printf("%14ld ", usage);
+		if (rsvd_limit == -2)
+			printf("%14s %14s\n", "-", "-");
+		else if (rsvd_limit == -1)
+			printf("%14s %14ld\n", "max", rsvd_usage);
+		else
+			printf("%14ld %14ld\n", rsvd_limit, rsvd_usage);
+	}
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((entry = readdir(d))) {
+		if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+			continue;
+		snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name);
+		cgroup_list_dir(root, path, pools, cnt);
+	}
+	closedir(d);
+}
+
+void cgroup_list(void)
+{
+	struct hpage_pool pools[MAX_POOLS];
+	const char *root;
+	int cnt;
+
+	root = cgroup2_mount();
+	if (!root) {
+		ERROR("No cgroup v2 hierarchy is mounted\n");
+		exit(EXIT_FAILURE);
+	}
+
+	cnt = hpool_sizes(pools, MAX_POOLS);
+	if (cnt < 0) {
+		ERROR("unable to obtain pools list");
+		exit(EXIT_FAILURE);
+	}
+	qsort(pools, cnt, sizeof(pools[0]), cmpsizes);
+
+	printf("%-40s %10s %14s %14s %14s %14s\n", "Cgroup", "Size",
+		"Limit", "Usage", "RsvdLimit", "RsvdUsage");
+	cgroup_list_dir(root, root, pools, cnt);
+}
+
+static void cgroup_write(const char *dir, const char *size, const char *file,
+				const char *value)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	snprintf(path, PATH_MAX, "%s/hugetlb.%s.%s", dir, size, file);
+
+	if (opt_dry_run) {
+		printf("echo '%s' > %s\n", value, path);
+		return;
+	}
+
+	f = fopen(path, "w");
+	if (!f || fprintf(f, "%s\n", value) < 0 || fclose(f)) {
+		ERROR("Unable to set %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	INFO("set %s to %s\n", path, value);
+}
+
+/*
+ * Apply a "<cgroup>:<size|DEFAULT>:<pagecount|memsize<G|M|K>|max>" limit.
+ * Both the fault limit and, where the kernel has one, the reservation
+ * limit are set so that mappings beyond the limit fail at mmap() time
+ * rather than with SIGBUS on first touch.
+ */
+void cgroup_set_limit(char *spec)
+{
+	char dir[PATH_MAX];
+	char size[16];
+	char value[32];
+	char *iter = NULL;
+	char *cgroup, *page_size_str, *limit_str;
+	const char *root;
+	long page_size;
+
+	cgroup = strtok_r(spec, ":", &iter);
+	page_size_str = strtok_r(NULL, ":", &iter);
+	limit_str = strtok_r(NULL, ":", &iter);
+	if (!cgroup || !page_size_str || !limit_str) {
+		ERROR("%s: invalid cgroup limit specification\n", spec);
+		exit(EXIT_FAILURE);
+	}
+
+	root = cgroup2_mount();
+	if (!root) {
+		ERROR("No cgroup v2 hierarchy is mounted\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (strncmp(cgroup, root, strlen(root)) == 0)
+		snprintf(dir, PATH_MAX, "%s", cgroup);
+	else
+		snprintf(dir, PATH_MAX, "%s/%s", root,
+			cgroup[0] == '/' ? cgroup + 1 : cgroup);
+
+	if (strcmp(page_size_str, "DEFAULT") == 0)
+		page_size = kernel_default_hugepage_size();
+	else
+		page_size = parse_page_size(page_size_str);
+	if (page_size <= 0) {
+		ERROR("%s: invalid page size\n", page_size_str);
+		exit(EXIT_FAILURE);
+	}
+
+	hugetlb_cgroup_size_name(size, sizeof(size), page_size);
+	if (hugetlb_cgroup_read(dir, page_size, "max") == -2) {
+		ERROR("%s has no hugetlb controller for %s pages\n", dir, size);
+		exit(EXIT_FAILURE);
+	}
+
+	if (strcmp(limit_str, "max") == 0)
+		snprintf(value, sizeof(value), "max");
+	else
+		snprintf(value, sizeof(value), "%ld",
+			value_adjust(limit_str, 0, page_size) * page_size);
+
+	cgroup_write(dir, size, "max", value);
+	if (hugetlb_cgroup_read(dir, page_size, "rsvd.max") != -2)
+		cgroup_write(dir, size, "rsvd.max", value);
+}
+
+/*
+ * --apply brings the system in line with a configuration file describing
+ * the desired pools, mounts, sysctls and transparent huge page settings.
+ * Only settings that differ from the current state are changed, so the
+ * same file can be applied on every boot.
+ */
+#define APPLY_MAX_ENTRIES	64
+#define APPLY_LINEBUF		1024
+
+struct apply_pool {
+	long page_size;
+	int node;
+	long min;
+	long max;
+};
+
+struct apply_mount {
+	char path[PATH_MAX];
+	long page_size;
+	unsigned long size;
+	int inodes;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+};
+
+struct apply_sysctl {
+	char name[NAME_MAX];
+	char value[OPT_MAX];
+};
+
+struct apply_config {
+	struct apply_pool pools[APPLY_MAX_ENTRIES];
+	int nr_pools;
+	struct apply_mount mounts[APPLY_MAX_ENTRIES];
+	int nr_mounts;
+	struct apply_sysctl sysctls[APPLY_MAX_ENTRIES];
+	int nr_sysctls;
+	char thp_enabled[OPT_MAX];
+	long khuge_pages;
+	long khuge_scan;
+	long khuge_alloc;
+};
+
+#define APPLY_ERROR(file, line, format, ...)				\
+	do {								\
+		ERROR("%s:%d: " format, file, line, ##__VA_ARGS__);	\
+		exit(EXIT_FAILURE);					\
+	} while (0)
+
+static char *apply_key(char *token, const char *key)
+{
+	size_t len = strlen(key);
+
+	if (strncmp(token, key, len) == 0 && token[len] == '=')
+		return token + len + 1;
+	return NULL;
+}
+
+static long apply_page_size(char *str)
+{
+	if (strcmp(str, "DEFAULT") == 0)
+		return kernel_default_hugepage_size();
+	return parse_page_size(str);
+}
+
+static long apply_count(char *str, long page_size)
+{
+	if (*str == '+' || *str == '-')
+		return -1;
+	return value_adjust(str, 0, page_size);
+}
+
+/*
+ * pool <size|DEFAULT> [node=<node>] [min=<count|memsize>] [max=<count|memsize>]
+ */
+static void apply_parse_pool(struct apply_config *cfg, char *file, int line,
+				char **iter)
+{
+	struct apply_pool *pool;
+	char *token, *value;
+
+	if (cfg->nr_pools == APPLY_MAX_ENTRIES)
+		APPLY_ERROR(file, line, "too many pool entries\n");
+	pool = &cfg->pools[cfg->nr_pools++];
+	pool->node = -1;
+	pool->min = pool->max = -1;
+
+	token = strtok_r(NULL, " \t\n", iter);
+	if (!token)
+		APPLY_ERROR(file, line, "pool needs a page size\n");
+	pool->page_size = apply_page_size(token);
+	if (pool->page_size <= 0)
+		APPLY_ERROR(file, line, "%s: invalid page size\n", token);
+
+	while ((token = strtok_r(NULL, " \t\n", iter))) {
+		if ((value = apply_key(token, "node")))
+			pool->node = atoi(value);
+		else if ((value = apply_key(token, "min")))
+			pool->min = apply_count(value, pool->page_size);
+		else if ((value = apply_key(token, "max")))
+			pool->max = apply_count(value, pool->page_size);
+		else
+			APPLY_ERROR(file, line, "%s: unknown pool setting\n",
+					token);
+		if (value && (pool->min < -1 || pool->max < -1 ||
+		    *value == '+' || *value == '-'))
+			APPLY_ERROR(file, line, "%s: invalid count\n", token);
+	}
+
+	if (pool->min < 0 && pool->max < 0)
+		APPLY_ERROR(file, line, "pool needs min= or max=\n");
+	if (pool->node >= 0 && pool->max >= 0)
+		APPLY_ERROR(file, line, "max= cannot be set per node\n");
+	if (pool->min >= 0 && pool->max >= 0 && pool->max < pool->min)
+		APPLY_ERROR(file, line, "max= is below min=\n");
+}
+
+/*
+ * mount <path> pagesize=<size|DEFAULT> [size=<size<G|M|K>>] [inodes=<count>]
+ *       [user=<user>] [group=<group>] [mode=<octal>]
+ */
+static void apply_parse_mount(struct apply_config *cfg, char *file, int line,
+				char **iter)
+{
+	struct apply_mount *mnt;
+	struct passwd *pwd;
+	struct group *grp;
+	char *token, *value;
+
+	if (cfg->nr_mounts == APPLY_MAX_ENTRIES)
+		APPLY_ERROR(file, line, "too many mount entries\n");
+	mnt = &cfg->mounts[cfg->nr_mounts++];
+	mnt->mode = S_IRWXU | S_IRWXG;
+
+	token = strtok_r(NULL, " \t\n", iter);
+	if (!token || token[0] != '/')
+		APPLY_ERROR(file, line, "mount needs an absolute path\n");
+	snprintf(mnt->path, PATH_MAX, "%s", token);
+
+	while ((token = strtok_r(NULL, " \t\n", iter))) {
+		if ((value = apply_key(token, "pagesize"))) {
+			mnt->page_size = apply_page_size(value);
+			if (mnt->page_size <= 0)
+				APPLY_ERROR(file, line,
+					"%s: invalid page size\n", value);
+		} else if ((value = apply_key(token, "size"))) {
+			/* Not a pagesize, but the conversions the same */
+			if (parse_page_size(value) <= 0)
+				APPLY_ERROR(file, line,
+					"%s: invalid size\n", value);
+			mnt->size = parse_page_size(value);
+		} else if ((value = apply_key(token, "inodes"))) {
+			mnt->inodes = atoi(value);
+		} else if ((value = apply_key(token, "user"))) {
+			pwd = getpwnam(value);
+			if (!pwd)
+				APPLY_ERROR(file, line,
+					"could not find user %s\n", value);
+			mnt->uid = pwd->pw_uid;
+		} else if ((value = apply_key(token, "group"))) {
+			grp = getgrnam(value);
+			if (!grp)
+				APPLY_ERROR(file, line,
+					"could not find group %s\n", value);
+			mnt->gid = grp->gr_gid;
+		} else if ((value = apply_key(token, "mode"))) {
+			mnt->mode = strtoul(value, NULL, 8) & 07777;
+		} else
+			APPLY_ERROR(file, line, "%s: unknown mount setting\n",
+					token);
+	}
+
+	if (!mnt->page_size)
+		APPLY_ERROR(file, line, "mount needs pagesize=\n");
+}
+
+/*
+ * sysctl <name>=<value>
+ *
+ * kernel.shmmax and vm.min_free_kbytes accept "recommended", and
+ * vm.hugetlb_shm_group accepts a group name.
+ */
+static void apply_parse_sysctl(struct apply_config *cfg, char *file, int line,
+				char **iter)
+{
+	struct apply_sysctl *sysctl;
+	char *token, *value;
+
+	if (cfg->nr_sysctls == APPLY_MAX_ENTRIES)
+		APPLY_ERROR(file, line, "too many sysctl entries\n");
+	sysctl = &cfg->sysctls[cfg->nr_sysctls++];
+
+	token = strtok_r(NULL, " \t\n", iter);
+	value = token ? strchr(token, '=') : NULL;
+	if (!value || value == token || !value[1])
+		APPLY_ERROR(file, line, "sysctl needs <name>=<value>\n");
+	*value++ = '\0';
+
+	if (strchr(token, '/') || strstr(token, ".."))
+		APPLY_ERROR(file, line, "%s: invalid sysctl name\n", token);
+
+	snprintf(sysctl->name, NAME_MAX, "%s", token);
+	snprintf(sysctl->value, OPT_MAX, "%s", value);
+}
+
+/*
+ * thp [enabled=always|madvise|never] [khugepaged-pages=<pages>]
+ *     [khugepaged-scan-sleep=<ms>] [khugepaged-alloc-sleep=<ms>]
+ */
+static void apply_parse_thp(struct apply_config *cfg, char *file, int line,
+				char **iter)
+{
+	char *token, *value;
+
+	while ((token = strtok_r(NULL, " \t\n", iter))) {
+		if ((value = apply_key(token, "enabled"))) {
+			if (strcmp(value, ALWAYS) && strcmp(value, MADVISE) &&
+			    strcmp(value, NEVER))
+				APPLY_ERROR(file, line,
+					"%s: invalid THP mode\n", value);
+			snprintf(cfg->thp_enabled, OPT_MAX, "%s", value);
+		} else if ((value = apply_key(token, "khugepaged-pages")))
+			cfg->khuge_pages = atol(value);
+		else if ((value = apply_key(token, "khugepaged-scan-sleep")))
+			cfg->khuge_scan = atol(value);
+		else if ((value = apply_key(token, "khugepaged-alloc-sleep")))
+			cfg->khuge_alloc = atol(value);
+		else
+			APPLY_ERROR(file, line, "%s: unknown thp setting\n",
+					token);
+	}
+}
+
+struct apply_config *apply_parse(char *file)
+{
+	struct apply_config *cfg;
+	char buf[APPLY_LINEBUF];
+	char *iter, *token;
+	int line = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		ERROR("Unable to open %s: %s\n", file, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	cfg = calloc(1, sizeof(*cfg));
+	if (!cfg) {
+		ERROR("out of memory");
+		exit(EXIT_FAILURE);
+	}
+	cfg->khuge_pages = cfg->khuge_scan = cfg->khuge_alloc = -1;
+
+	while (fgets(buf, APPLY_LINEBUF, f)) {
+		line++;
+		if ((token = strchr(buf, '#')))
+			*token = '\0';
+
+		iter = NULL;
+		token = strtok_r(buf, " \t\n", &iter);
+		if (!token)
+			continue;
+
+		if (strcmp(token, "pool") == 0)
+			apply_parse_pool(cfg, file, line, &iter);
+		else if (strcmp(token, "mount") == 0)
+			apply_parse_mount(cfg, file, line, &iter);
+		else if (strcmp(token, "sysctl") == 0)
+			apply_parse_sysctl(cfg, file, line, &iter);
+		else if (strcmp(token, "thp") == 0)
+			apply_parse_thp(cfg, file, line, &iter);
+		else
+			APPLY_ERROR(file, line, "%s: unknown directive\n",
+					token);
+	}
+	fclose(f);
+
+	return cfg;
+}
+
+static int apply_pool(struct apply_pool *pool)
+{
+	struct hpage_pool pools[MAX_POOLS];
+	char cmd[OPT_MAX];
+	char path[PATH_MAX];
+	long current, expected = 0;
+	int cnt, pos;
+
+	if (pool->node >= 0) {
+		current = read_node_counter(pool->node, pool->page_size,
+						"nr_hugepages");
+		if (current < 0) {
+			ERROR("node %d has no %ldkB pool\n", pool->node,
+				pool->page_size / 1024);
+			return 1;
+		}
+		if (current == pool->min)
+			return 0;
+
+		node_counter_path(path, pool->node, pool->page_size,
+					"nr_hugepages");
+		if (opt_dry_run) {
+			printf("echo %ld > %s\n", pool->min, path);
+			return 0;
+		}
+
+		if (pool->min > current)
+			expected = prepare_pool_growth(pool->page_size,
+							pool->min - current);
+		file_write_ulong(path, pool->min);
+		if (pool->min > current)
+			report_pool_growth(pool->page_size, expected,
+				read_node_counter(pool->node, pool->page_size,
+					"nr_hugepages") - current);
+		return 0;
+	}
+
+	cnt = hpool_sizes(pools, MAX_POOLS);
+	for (pos = 0; pos < cnt; pos++)
+		if (pools[pos].pagesize == pool->page_size)
+			break;
+	if (pos >= cnt) {
+		ERROR("%ldkB: unknown page size\n", pool->page_size / 1024);
+		return 1;
+	}
+
+	if (pool->min >= 0 && (unsigned long)pool->min != pools[pos].minimum) {
+		snprintf(cmd, OPT_MAX, "%ld:%ld", pool->page_size, pool->min);
+		if (opt_dry_run)
+			printf("hugeadm --pool-pages-min %s\n", cmd);
+		else if (!kernel_has_overcommit())
+			pool_adjust(cmd, POOL_BOTH);
+		else
+			pool_adjust(cmd, POOL_MIN);
+	}
+
+	if (pool->max >= 0 && (unsigned long)pool->max != pools[pos].maximum) {
+		snprintf(cmd, OPT_MAX, "%ld:%ld", pool->page_size, pool->max);
+		if (opt_dry_run)
+			printf("hugeadm --pool-pages-max %s\n", cmd);
+		else
+			pool_adjust(cmd, POOL_MAX);
+	}
+
+	return 0;
+}
+
+/* Pages the pool entries for one size will add to its pool */
+static long apply_growth_needed(struct apply_config *cfg, long page_size)
+{
+	struct hpage_pool pools[MAX_POOLS];
+	struct apply_pool *pool;
+	long current, needed = 0;
+	int i, cnt, pos;
+
+	cnt = hpool_sizes(pools, MAX_POOLS);
+	for (i = 0; i < cfg->nr_pools; i++) {
+		pool = &cfg->pools[i];
+		if (pool->page_size != page_size || pool->min < 0)
+			continue;
+
+		current = -1;
+		if (pool->node >= 0) {
+			current = read_node_counter(pool->node, page_size,
+							"nr_hugepages");
+		} else {
+			for (pos = 0; pos < cnt; pos++)
+				if (pools[pos].pagesize == page_size)
+					current = pools[pos].size;
+		}
+		if (current >= 0 && pool->min > current)
+			needed += pool->min - current;
+	}
+	return needed;
+}
+
+/*
+ * Pools of different sizes do not share counters, so each size is
+ * resized by its own child and the slow allocations proceed in parallel.
+ * Entries for the same size are applied in file order by one child.
+ */
+static pid_t apply_pools_of_size(struct apply_config *cfg, long page_size)
+{
+	pid_t pid;
+	int i, ret = 0;
+
+	/* Keep dry-run output in file order */
+	if (!opt_dry_run) {
+		fflush(NULL);
+		pid = fork();
+		if (pid < 0) {
+			ERROR("Unable to fork: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (pid > 0)
+			return pid;
+	}
+
+	for (i = 0; i < cfg->nr_pools; i++)
+		if (cfg->pools[i].page_size == page_size)
+			ret |= apply_pool(&cfg->pools[i]);
+
+	if (!opt_dry_run)
+		exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+	return 0;
+}
+
+/* Value of a numeric hugetlbfs mount option, 0 if it is not set */
+static long apply_mount_opt(struct mntent *entry, const char *opt)
+{
+	char value[32];
+	size_t len = strlen(opt);
+	char *p = hasmntopt(entry, opt);
+
+	if (!p || p[len] != '=')
+		return 0;
+	p += len + 1;
+	snprintf(value, sizeof(value), "%.*s", (int)strcspn(p, ","), p);
+	return parse_page_size(value);
+}
+
+/*
+ * A path that is already mounted must match its declaration.  hugetlbfs
+ * ignores new options on a remount, so a difference is reported for the
+ * administrator to unmount rather than silently left in place.
+ */
+static int apply_mount_matches(struct apply_mount *mnt, struct mntent *entry)
+{
+	long size = ALIGN_DOWN((long)mnt->size, mnt->page_size);
+	long value;
+	int ret = 1;
+
+	value = apply_mount_opt(entry, "pagesize");
+	if (value != mnt->page_size) {
+		ERROR("%s is mounted with %ldkB pages, %ldkB declared\n",
+			mnt->path, value / 1024, mnt->page_size / 1024);
+		ret = 0;
+	}
+	value = apply_mount_opt(entry, "size");
+	if (value != size) {
+		ERROR("%s is mounted with size=%ld, %ld declared\n",
+			mnt->path, value, size);
+		ret = 0;
+	}
+	value = apply_mount_opt(entry, "nr_inodes");
+	if (value != mnt->inodes) {
+		ERROR("%s is mounted with nr_inodes=%ld, %d declared\n",
+			mnt->path, value, mnt->inodes);
+		ret = 0;
+	}
+	if (!ret)
+		ERROR("Unmount %s to apply its declaration\n", mnt->path);
+	return ret;
+}
+
+static int apply_mount(struct apply_mount *mnt)
+{
+	struct mount_list *list, *current;
+	char options[OPT_MAX];
+	int len, mounted = 0, matches = 1;
+	struct stat st;
+
+	len = snprintf(options, OPT_MAX, "pagesize=%ld", mnt->page_size);
+	if (mnt->size)
+		len += snprintf(options + len, OPT_MAX - len, ",size=%lu",
+				mnt->size);
+	if (mnt->inodes)
+		snprintf(options + len, OPT_MAX - len, ",nr_inodes=%d",
+				mnt->inodes);
+
+	list = collect_active_mounts(NULL);
+	for (current = list; current; current = current->next) {
+		if (strcmp(current->entry.mnt_dir, mnt->path))
+			continue;
+		mounted = 1;
+		matches = apply_mount_matches(mnt, &current->entry);
+		break;
+	}
+	while (list) {
+		current = list;
+		list = list->next;
+		free(current);
+	}
+
+	if (!matches)
+		return 1;
+	if (!mounted) {
+		if (ensure_dir(mnt->path, mnt->mode, mnt->uid, mnt->gid))
+			return 1;
+		if (mount_dir(mnt->path, options, mnt->mode, mnt->uid,
+				mnt->gid))
+			return 1;
+	}
+
+	if (opt_dry_run || stat(mnt->path, &st))
+		return 0;
+
+	if ((st.st_uid != mnt->uid || st.st_gid != mnt->gid) &&
+	    chown(mnt->path, mnt->uid, mnt->gid)) {
+		ERROR("Unable to change ownership of %s, error: %s\n",
+			mnt->path, strerror(errno));
+		return 1;
+	}
+	if ((st.st_mode & 07777) != mnt->mode && chmod(mnt->path, mnt->mode)) {
+		ERROR("Unable to set permissions on %s, error: %s\n",
+			mnt->path, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int apply_sysctl(struct apply_sysctl *sysctl)
+{
+	char path[PATH_MAX];
+	struct group *grp;
+	unsigned long value;
+	char *p, *end;
+
+	snprintf(path, PATH_MAX, "/proc/sys/%s", sysctl->name);
+	for (p = path + strlen("/proc/sys/"); *p; p++)
+		if (*p == '.')
+			*p = '/';
+
+	if (strcmp(sysctl->value, "recommended") == 0) {
+		if (strcmp(path, PROCSHMMAX) == 0) {
+			value = recommended_shmmax();
+			if (value == 0) {
+				WARNING("We can only set a recommended shmmax when huge pages are configured!\n");
+				return 0;
+			}
+		} else if (strcmp(path, PROCMINFREEKBYTES) == 0) {
+			value = recommended_minfreekbytes();
+		} else {
+			ERROR("%s has no recommended value\n", sysctl->name);
+			return 1;
+		}
+	} else {
+		value = strtoul(sysctl->value, &end, 0);
+		if (*end) {
+			grp = strcmp(path, PROCHUGETLBGROUP) ? NULL :
+						getgrnam(sysctl->value);
+			if (!grp) {
+				ERROR("%s: invalid value for %s\n",
+					sysctl->value, sysctl->name);
+				return 1;
+			}
+			value = grp->gr_gid;
+		}
+	}
+
+	if ((unsigned long)file_read_ulong(path, NULL) == value)
+		return 0;
+
+	if (opt_dry_run) {
+		printf("echo \"%lu\" > %s\n", value, path);
+		return 0;
+	}
+
+	INFO("setting %s to %lu\n", sysctl->name, value);
+	return file_write_ulong(path, value) ? 1 : 0;
+}
+
+/*
+ * The THP enabled file lists every mode with the active one in brackets.
+ */
+static int thp_mode_is(const char *mode)
+{
+	char buf[OPT_MAX];
+	char active[OPT_MAX];
+	FILE *f;
+	char *p;
+	int ret = 0;
+
+	f = fopen(TRANS_ENABLE, "r");
+	if (!f)
+		return 0;
+	if (fgets(buf, OPT_MAX, f) && (p = strchr(buf, '['))) {
+		snprintf(active, OPT_MAX, "[%s]", mode);
+		ret = strncmp(p, active, strlen(active)) == 0;
+	}
+	fclose(f);
+
+	return ret;
+}
+
+static void apply_thp_value(const char *file, long value)
+{
+	char buf[OPT_MAX];
+
+	if (value < 0 || file_read_ulong((char *)file, NULL) == value)
+		return;
+
+	snprintf(buf, OPT_MAX, "%ld", value);
+	set_trans_opt(file, buf);
+}
+
+void apply_config(char *file)
+{
+	struct apply_config *cfg;
+	long sizes[MAX_POOLS];
+	pid_t children[MAX_POOLS];
+	int nr_sizes = 0, nr_children = 0;
+	int i, j, status, ret = 0;
+	long needed, expected;
+
+	if (geteuid() != 0 && !opt_dry_run) {
+		ERROR("Configuration can only be applied by root\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Parse everything first so a bad file changes nothing */
+	cfg = apply_parse(file);
+
+	for (i = 0; i < cfg->nr_pools; i++) {
+		for (j = 0; j < nr_sizes; j++)
+			if (sizes[j] == cfg->pools[i].page_size)
+				break;
+		if (j == nr_sizes && nr_sizes < MAX_POOLS)
+			sizes[nr_sizes++] = cfg->pools[i].page_size;
+	}
+
+	/* Drop caches and compact here, once, rather than in each child */
+	for (i = 0; i < nr_sizes; i++) {
+		needed = apply_growth_needed(cfg, sizes[i]);
+		expected = needed > 0 ? prepare_pool_growth(sizes[i], needed) : 0;
+		planned_growth[nr_planned_growth].page_size = sizes[i];
+		planned_growth[nr_planned_growth++].expected = expected;
+	}
+
+	for (i = 0; i < nr_sizes; i++) {
+		children[nr_children] = apply_pools_of_size(cfg, sizes[i]);
+		if (children[nr_children] > 0)
+			nr_children++;
+	}
+
+	/* Mounts and THP do not depend on the pools, apply them meanwhile */
+	if (cfg->thp_enabled[0] && !thp_mode_is(cfg->thp_enabled))
+		set_trans_opt(TRANS_ENABLE, cfg->thp_enabled);
+	apply_thp_value(KHUGE_SCAN_PAGES, cfg->khuge_pages);
+	apply_thp_value(KHUGE_SCAN_SLEEP, cfg->khuge_scan);
+	apply_thp_value(KHUGE_ALLOC_SLEEP, cfg->khuge_alloc);
+
+	for (i = 0; i < cfg->nr_mounts; i++)
+		ret |= apply_mount(&cfg->mounts[i]);
+
+	for (i = 0; i < nr_children; i++) {
+		if (waitpid(children[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	}
+
+	/* Recommended sysctl values are derived from the final pools */
+	for (i = 0; i < cfg->nr_sysctls; i++)
+		ret |= apply_sysctl(&cfg->sysctls[i]);
+
+	free(cfg);
+
+	if (ret) {
+		ERROR("Some settings in %s could not be applied\n", file);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int ops;
+	int has_hugepages = kernel_has_hugepages();
+
+	char opts[] = "+hdv";
+	char base[PATH_MAX];
+	char *opt_min_adj[MAX_POOLS], *opt_max_adj[MAX_POOLS];
+	char *opt_daemon_headroom[MAX_POOLS];
+	char *opt_apply = NULL;
+	char *opt_cgroup_limit[MAX_POOLS];
+	int cgroup_limit_count = 0, opt_cgroup_list = 0;
+	char *opt_user_mounts = NULL, *opt_group_mounts = NULL;
+	int opt_list_mounts = 0, opt_pool_list = 0, opt_create_mounts = 0;
+	int opt_pool_plan = 0, opt_update_mount_cache = 0;
+	int opt_global_mounts = 0, opt_pgsizes = 0, opt_pgsizes_all = 0;
+	int opt_explain = 0, minadj_count = 0, maxadj_count = 0;
+	int opt_trans_always = 0, opt_trans_never = 0, opt_trans_madvise = 0;
+	int opt_khuge_pages = 0, opt_khuge_scan = 0, opt_khuge_alloc = 0;
+	int opt_daemon = 0, headroom_count = 0, opt_watch = 0;
+	int ret = 0, index = 0, i;
+	char *end;
+	long val;
+	char *khuge_pages = NULL, *khuge_alloc = NULL, *khuge_scan = NULL;
+	gid_t opt_gid = 0;
+	struct group *opt_grp = NULL;
+	int group_invalid = 0;
+	struct option long_opts[] = {
+		{"help",       no_argument, NULL, 'h'},
+		{"verbose",    required_argument, NULL, 'v' },
+
+		{"list-all-mounts", no_argument, NULL, LONG_LIST_ALL_MOUNTS},
+		{"pool-list", no_argument, NULL, LONG_POOL_LIST},
+		{"pool-plan", no_argument, NULL, LONG_POOL_PLAN},
+		{"pool-pages-min", required_argument, NULL, LONG_POOL_MIN_ADJ},
+		{"pool-pages-max", required_argument, NULL, LONG_POOL_MAX_ADJ},
+		{"obey-mempolicy", no_argument, NULL, LONG_POOL_MEMPOL},
+		{"thp-always", no_argument, NULL, LONG_TRANS_ALWAYS},
+		{"thp-madvise", no_argument, NULL, LONG_TRANS_MADVISE},
+		{"thp-never", no_argument, NULL, LONG_TRANS_NEVER},
+		{"thp-khugepaged-pages", required_argument, NULL, LONG_KHUGE_PAGES},
+		{"thp-khugepaged-scan-sleep", required_argument, NULL, LONG_KHUGE_SCAN},
+		{"thp-khugepaged-alloc-sleep", required_argument, NULL, LONG_KHUGE_ALLOC},
+		{"set-recommended-min_free_kbytes", no_argument, NULL, LONG_SET_RECOMMENDED_MINFREEKBYTES},
+		{"set-recommended-shmmax", no_argument, NULL, LONG_SET_RECOMMENDED_SHMMAX},
+		{"set-shm-group", required_argument, NULL, LONG_SET_HUGETLB_SHM_GROUP},
+		{"enable-zone-movable", no_argument, NULL, LONG_MOVABLE_ENABLE},
+		{"disable-zone-movable", no_argument, NULL, LONG_MOVABLE_DISABLE},
+		{"hard", no_argument, NULL, LONG_HARD},
 		{"add-temp-swap", optional_argument, NULL, LONG_SWAP_DISK},
 		{"add-ramdisk-swap", no_argument, NULL, LONG_SWAP_RAMDISK},
 		{"persist", no_argument, NULL, LONG_SWAP_PERSIST},
@@ -1409,6 +3246,7 @@ int main(int argc, char** argv)
 		{"create-user-mounts", required_argument, NULL, LONG_CREATE_USER_MOUNTS},
 		{"create-group-mounts", required_argument, NULL, LONG_CREATE_GROUP_MOUNTS},
 		{"create-global-mounts", no_argument, NULL, LONG_CREATE_GLOBAL_MOUNTS},
+		{"update-mount-cache", no_argument, NULL, LONG_UPDATE_MOUNT_CACHE},
 
 		{"max-size", required_argument, NULL, LONG_LIMIT_SIZE},
 		{"max-inodes", required_argument, NULL, LONG_LIMIT_INODES},
@@ -1417,6 +3255,16 @@ int main(int argc, char** argv)
 		{"page-sizes-all", no_argument, NULL, LONG_PAGE_AVAIL},
 		{"dry-run", no_argument, NULL, 'd'},
 		{"explain", no_argument, NULL, LONG_EXPLAIN},
+		{"apply", required_argument, NULL, LONG_APPLY},
+		{"json", no_argument, NULL, LONG_JSON},
+		{"watch", required_argument, NULL, LONG_WATCH},
+		{"cgroup-list", no_argument, NULL, LONG_CGROUP_LIST},
+		{"cgroup-limit", required_argument, NULL, LONG_CGROUP_LIMIT},
+
+		{"daemon", optional_argument, NULL, LONG_DAEMON},
+		{"daemon-headroom", required_argument, NULL, LONG_DAEMON_HEADROOM},
+		{"daemon-idle", required_argument, NULL, LONG_DAEMON_IDLE},
+		{"daemon-rate", required_argument, NULL, LONG_DAEMON_RATE},
 
 		{0},
 	};
@@ -1485,6 +3333,10 @@ int main(int argc, char** argv)
 			opt_pool_list = 1;
 			break;
 
+		case LONG_POOL_PLAN:
+			opt_pool_plan = 1;
+			break;
+
 		case LONG_POOL_MIN_ADJ:
 			if (minadj_count == MAX_POOLS) {
 				WARNING("Attempting to adjust an invalid "
@@ -1581,6 +3433,10 @@ int main(int argc, char** argv)
 			opt_create_mounts = 1;
 			break;
 
+		case LONG_UPDATE_MOUNT_CACHE:
+			opt_update_mount_cache = 1;
+			break;
+
 		case LONG_CREATE_USER_MOUNTS:
 			opt_user_mounts = optarg;
 			break;
@@ -1616,6 +3472,75 @@ int main(int argc, char** argv)
 			opt_explain = 1;
 			break;
 
+		case LONG_APPLY:
+			opt_apply = optarg;
+			break;
+
+		case LONG_JSON:
+			opt_json = 1;
+			break;
+
+		case LONG_WATCH:
+			opt_watch = atoi(optarg);
+			if (opt_watch <= 0) {
+				ERROR("Invalid watch interval (%s)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case LONG_CGROUP_LIST:
+			opt_cgroup_list = 1;
+			break;
+
+		case LONG_CGROUP_LIMIT:
+			if (cgroup_limit_count == MAX_POOLS) {
+				WARNING("Too many cgroup limits, "
+					"ignoring request: '%s'\n", optarg);
+			} else {
+				opt_cgroup_limit[cgroup_limit_count++] = optarg;
+			}
+			break;
+
+		case LONG_DAEMON:
+			opt_daemon = 5;
+			if (optarg)
+				opt_daemon = atoi(optarg);
+			if (opt_daemon <= 0) {
+				ERROR("Invalid daemon interval (%s)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case LONG_DAEMON_HEADROOM:
+			if (headroom_count == MAX_POOLS) {
+				WARNING("Too many headroom specifications, "
+					"ignoring request: '%s'\n", optarg);
+			} else {
+				opt_daemon_headroom[headroom_count++] = optarg;
+			}
+			break;
+
+		case LONG_DAEMON_IDLE:
+			errno = 0;
+			val = strtol(optarg, &end, 10);
+			if (errno || end == optarg || *end || val < 0 ||
+			    val > INT_MAX) {
+				ERROR("Invalid daemon idle time (%s)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			opt_daemon_idle = val;
+			break;
+
+		case LONG_DAEMON_RATE:
+			errno = 0;
+			opt_daemon_rate = strtol(optarg, &end, 10);
+			if (errno || end == optarg || *end ||
+			    opt_daemon_rate <= 0) {
+				ERROR("Invalid daemon rate (%s)\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		default:
 			WARNING("unparsed option %08x\n", ret);
 			ret = -1;
@@ -1633,6 +3558,12 @@ int main(int argc, char** argv)
 	if (opt_pool_list)
 		pool_list();
 
+	if (opt_pool_plan)
+		pool_plan();
+
+	if (opt_cgroup_list)
+		cgroup_list();
+
 	if (opt_movable != -1)
 		setup_zone_movable(opt_movable);
 
@@ -1663,6 +3594,12 @@ int main(int argc, char** argv)
 	if (opt_set_hugetlb_shm_group)
 		set_hugetlb_shm_group(opt_gid, opt_grp->gr_name);
 
+	if (opt_apply)
+		apply_config(opt_apply);
+
+	for (i = 0; i < cgroup_limit_count; i++)
+		cgroup_set_limit(opt_cgroup_limit[i]);
+
 	while (--minadj_count >= 0) {
 		if (! kernel_has_overcommit())
 			pool_adjust(opt_min_adj[minadj_count], POOL_BOTH);
@@ -1694,6 +3631,14 @@ int main(int argc, char** argv)
 		create_mounts(NULL, NULL, base, S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX );
 	}
 
+	/* Keep the mount cache in step with any mounts created above */
+	if ((opt_update_mount_cache || opt_create_mounts || opt_user_mounts ||
+	     opt_group_mounts || opt_global_mounts || opt_apply) &&
+	    !opt_dry_run) {
+		if (write_mount_cache() && opt_update_mount_cache)
+			exit(EXIT_FAILURE);
+	}
+
 	if (opt_pgsizes)
 		page_sizes(0);
 
@@ -1710,5 +3655,17 @@ int main(int argc, char** argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (opt_watch && opt_daemon) {
+		ERROR("--watch and --daemon cannot be used together\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (opt_watch)
+		pool_watch(opt_watch);
+
+	/* Any one-shot pool adjustments above set the bounds of the daemon */
+	if (opt_daemon)
+		pool_daemon(opt_daemon, opt_daemon_headroom, headroom_count);
+
 	exit(EXIT_SUCCESS);
 }
@@ -28,8 +28,11 @@
 #include <link.h>
 #include <getopt.h>
 #include <errno.h>
+#include <dirent.h>
+#include <ftw.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 
 /*
  * Eventually we plan to use the libhugetlbfs reporting facility,
@@ -52,6 +55,17 @@
 #define MAP_TEXT	0x0002
 #define MAP_DATA	0x0004
 
+/*
+ * Options of the --estimate mode are tagged with EST_BASE in the same way.
+ */
+#define EST_BASE	0x2000
+#define EST_ESTIMATE	0x0001
+#define EST_SHARE	0x0002
+#define EST_PEAK_RSS	0x0003
+#define EST_PROCESSES	0x0004
+#define EST_ANALYZE	0x0005
+#define EST_JOBS	0x0006
+
 #define PF_LINUX_HUGETLB	0x100000
 extern int optind;
 extern char *optarg;
@@ -66,6 +80,17 @@ void print_usage()
 	OPTION("--text", "Remap program text into huge pages by default");
 	OPTION("--data", "Remap program data into huge pages by default");
 	OPTION("--disable", "Remap no segments into huge pages by default");
+	OPTION("--estimate[=<elfmap>]", "Report the huge pages needed to remap");
+	CONT("the binary.  <elfmap> takes the HUGETLB_ELFMAP syntax, by default");
+	CONT("the segments flagged for huge pages use the default size");
+	OPTION("--share", "Estimate with read-only segments shared");
+	CONT("between processes as with HUGETLB_SHARE=1");
+	OPTION("--peak-rss <size<G|M|K>>", "Estimate the heap from the peak RSS");
+	CONT("of the program, as used with HUGETLB_MORECORE");
+	OPTION("--processes <count>", "Number of processes to size pools for");
+	OPTION("--analyze", "Treat target as a directory and report, for");
+	CONT("every executable below it, what huge pages would gain");
+	OPTION("--jobs <count>", "Binaries to analyze in parallel with --analyze");
 	OPTION("--help, -h", "Print this usage information");
 }
 
@@ -156,6 +181,623 @@ void update_phdrs##_BITS_(Elf##_BITS_##_Ehdr *ehdr, int remap_opts)	\
 update_phdrs(32)
 update_phdrs(64)
 
+/*
+ * --estimate works out how many huge pages the library needs to remap a
+ * binary, following the rules of parse_elf_normal() and prepare_segment()
+ * in elflink.c.
+ */
+#define MAX_ESTIMATES	8
+
+struct page_estimate {
+	long page_size;
+	long shared;	/* Pages in hugetlbfs files shared by all processes */
+	long private;	/* Pages needed by each process */
+};
+
+static struct page_estimate estimates[MAX_ESTIMATES];
+static int nr_estimates;
+static long hpage_readonly_size, hpage_writable_size;
+static long default_hpage_size;
+static int use_segment_flags = 1;
+static int opt_share;
+
+static struct page_estimate *estimate_for(long page_size)
+{
+	int i;
+
+	for (i = 0; i < nr_estimates; i++)
+		if (estimates[i].page_size == page_size)
+			return &estimates[i];
+
+	if (nr_estimates == MAX_ESTIMATES) {
+		ERROR("Too many page sizes\n");
+		exit(EXIT_FAILURE);
+	}
+	estimates[nr_estimates].page_size = page_size;
+	return &estimates[nr_estimates++];
+}
+
+/* Same syntax and units as parse_page_size() in the library */
+static long parse_size(const char *str)
+{
+	char *pos;
+	long size;
+
+	size = strtol(str, &pos, 0);
+	if (size <= 0 || pos == str)
+		return -1;
+
+	switch (*pos) {
+	case 'G':
+	case 'g':
+		size *= 1024;
+	case 'M':
+	case 'm':
+		size *= 1024;
+	case 'K':
+	case 'k':
+		size *= 1024;
+	}
+
+	return size;
+}
+
+static long read_default_hpage_size(void)
+{
+	char line[128];
+	long size = -1;
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Hugepagesize: %ld kB", &size) == 1)
+			break;
+	fclose(f);
+
+	return size > 0 ? size * 1024 : -1;
+}
+
+/*
+ * Interpret an HUGETLB_ELFMAP value the way set_hpage_sizes() does.
+ */
+static void parse_elfmap(char *elfmap)
+{
+	char *pos;
+	long size;
+
+	if (strcasecmp(elfmap, "no") == 0) {
+		use_segment_flags = 0;
+		return;
+	}
+
+	pos = strcasestr(elfmap, "R");
+	if (pos) {
+		size = (pos[1] == '=') ? parse_size(pos + 2) :
+						default_hpage_size;
+		if (size <= 0) {
+			ERROR("Invalid read-only page size in %s\n", elfmap);
+			exit(EXIT_FAILURE);
+		}
+		hpage_readonly_size = size;
+	}
+
+	pos = strcasestr(elfmap, "W");
+	if (pos) {
+		size = (pos[1] == '=') ? parse_size(pos + 2) :
+						default_hpage_size;
+		if (size <= 0) {
+			ERROR("Invalid writable page size in %s\n", elfmap);
+			exit(EXIT_FAILURE);
+		}
+		hpage_writable_size = size;
+	}
+
+	if (hpage_readonly_size || hpage_writable_size)
+		use_segment_flags = 0;
+}
+
+/*
+ * Find the part of the BSS that get_extracopy() copies into the
+ * prepared file: up to the end of the last global or weak object in the
+ * BSS listed in the dynamic symbol table.  Without a dynamic symbol table
+ * the library copies the whole BSS.
+ */
+#define find_extrasz(_BITS_)						\
+unsigned long find_extrasz##_BITS_(Elf##_BITS_##_Ehdr *ehdr,		\
+		unsigned long size, unsigned long start,		\
+		unsigned long end_orig)					\
+{									\
+	Elf##_BITS_##_Shdr *shdr;					\
+	Elf##_BITS_##_Sym *sym;						\
+	unsigned long end = start;					\
+	unsigned long sym_end;						\
+	int i, numsyms;							\
+									\
+	if (!ehdr->e_shoff || ehdr->e_shoff + ehdr->e_shnum *		\
+			sizeof(*shdr) > size)				\
+		return end_orig - start;				\
+									\
+	shdr = (Elf##_BITS_##_Shdr *)((char *)ehdr + ehdr->e_shoff);	\
+	for (i = 0; i < ehdr->e_shnum; i++)				\
+		if (shdr[i].sh_type == SHT_DYNSYM)			\
+			break;						\
+	if (i == ehdr->e_shnum ||					\
+	    shdr[i].sh_offset + shdr[i].sh_size > size)		\
+		return end_orig - start;				\
+									\
+	sym = (Elf##_BITS_##_Sym *)((char *)ehdr + shdr[i].sh_offset);	\
+	numsyms = shdr[i].sh_size / sizeof(*sym);			\
+	for (i = 0; i < numsyms; i++) {					\
+		if (sym[i].st_value < start ||				\
+		    sym[i].st_value > end_orig)				\
+			continue;					\
+		if (ELF##_BITS_##_ST_BIND(sym[i].st_info) != STB_GLOBAL && \
+		    ELF##_BITS_##_ST_BIND(sym[i].st_info) != STB_WEAK)	\
+			continue;					\
+		if (ELF##_BITS_##_ST_TYPE(sym[i].st_info) != STT_OBJECT || \
+		    sym[i].st_size == 0)				\
+			continue;					\
+		sym_end = sym[i].st_value + sym[i].st_size;		\
+		if (sym_end > end)					\
+			end = sym_end;					\
+	}								\
+									\
+	return end - start;						\
+}
+find_extrasz(32)
+find_extrasz(64)
+
+/*
+ * For each remapped segment, the prepared hugetlbfs file holds the
+ * aligned file contents plus the extra copy window.  Read-only segments
+ * are mapped from that file, and when sharing it exists once for all
+ * processes.  Writable segments are mapped privately from their own
+ * file, so in the worst case every page is copied on write and both the
+ * file and the private copy are needed.
+ */
+#define estimate_phdrs(_BITS_)						\
+void estimate_phdrs##_BITS_(Elf##_BITS_##_Ehdr *ehdr, unsigned long size) \
+{									\
+	Elf##_BITS_##_Phdr *phdr;					\
+	struct page_estimate *est;					\
+	unsigned long offset, extrasz, file, mapped, prev_end = 0;	\
+	long page_size;							\
+	int i, writable;						\
+									\
+	phdr = (Elf##_BITS_##_Phdr *)((char *)ehdr + ehdr->e_phoff);	\
+	for (i = 0; i < ehdr->e_phnum; i++) {				\
+		if (phdr[i].p_type != PT_LOAD)				\
+			continue;					\
+									\
+		writable = phdr[i].p_flags & PF_W;			\
+		page_size = writable ? hpage_writable_size :		\
+					hpage_readonly_size;		\
+		if (use_segment_flags &&				\
+		    (phdr[i].p_flags & PF_LINUX_HUGETLB))		\
+			page_size = default_hpage_size;			\
+		if (page_size <= 0) {					\
+			printf("Segment %i 0x%llx - 0x%llx uses base "	\
+				"pages\n", i,				\
+				(unsigned long long)phdr[i].p_vaddr,	\
+				(unsigned long long)phdr[i].p_vaddr +	\
+					phdr[i].p_memsz);		\
+			continue;					\
+		}							\
+									\
+		offset = phdr[i].p_vaddr -				\
+				ALIGN_DOWN(phdr[i].p_vaddr, page_size);	\
+		extrasz = 0;						\
+		if (phdr[i].p_filesz != phdr[i].p_memsz)		\
+			extrasz = find_extrasz##_BITS_(ehdr, size,	\
+				phdr[i].p_vaddr + phdr[i].p_filesz,	\
+				phdr[i].p_vaddr + phdr[i].p_memsz);	\
+		file = ALIGN(offset + phdr[i].p_filesz + extrasz,	\
+				page_size) / page_size;			\
+		mapped = ALIGN(offset + phdr[i].p_memsz,		\
+				page_size) / page_size;			\
+									\
+		if (ALIGN_DOWN(phdr[i].p_vaddr, page_size) < prev_end)	\
+			WARNING("Segment %i would overlap the previous "\
+				"segment once aligned, the library will "\
+				"not remap this binary\n", i);		\
+		prev_end = ALIGN(phdr[i].p_vaddr + phdr[i].p_memsz,	\
+				page_size);				\
+									\
+		est = estimate_for(page_size);				\
+		if (!writable && opt_share) {				\
+			est->shared += file;				\
+			est->private += mapped - file;			\
+		} else if (!writable) {					\
+			est->private += mapped;				\
+		} else {						\
+			est->private += file + mapped;			\
+		}							\
+									\
+		printf("Segment %i 0x%llx - 0x%llx (%s) %ld byte pages:"\
+			" %lu in file (extra copy %lu bytes), %lu "	\
+			"mapped\n", i,					\
+			(unsigned long long)phdr[i].p_vaddr,		\
+			(unsigned long long)phdr[i].p_vaddr +		\
+				phdr[i].p_memsz,			\
+			writable ? "DATA" : "TEXT", page_size,		\
+			file, extrasz, mapped);				\
+	}								\
+}
+estimate_phdrs(32)
+estimate_phdrs(64)
+
+#define segments_memsz(_BITS_)						\
+unsigned long segments_memsz##_BITS_(Elf##_BITS_##_Ehdr *ehdr)		\
+{									\
+	Elf##_BITS_##_Phdr *phdr;					\
+	unsigned long total = 0;					\
+	int i;								\
+									\
+	phdr = (Elf##_BITS_##_Phdr *)((char *)ehdr + ehdr->e_phoff);	\
+	for (i = 0; i < ehdr->e_phnum; i++)				\
+		if (phdr[i].p_type == PT_LOAD)				\
+			total += phdr[i].p_memsz;			\
+	return total;							\
+}
+segments_memsz(32)
+segments_memsz(64)
+
+/*
+ * The heap is estimated as whatever the peak RSS does not attribute to
+ * the program's own segments.  Shared libraries and the stack are
+ * counted as heap too, so this errs on the side of a larger pool.
+ */
+void estimate(void *ehdr, unsigned long size, int wordsize,
+		long peak_rss, long processes)
+{
+	struct page_estimate *est;
+	unsigned long heap = 0;
+	long total;
+	int i;
+
+	if (wordsize == ELFCLASS64) {
+		estimate_phdrs64((Elf64_Ehdr *)ehdr, size);
+		if (peak_rss > 0)
+			heap = segments_memsz64((Elf64_Ehdr *)ehdr);
+	} else {
+		estimate_phdrs32((Elf32_Ehdr *)ehdr, size);
+		if (peak_rss > 0)
+			heap = segments_memsz32((Elf32_Ehdr *)ehdr);
+	}
+
+	if (peak_rss > 0) {
+		heap = (unsigned long)peak_rss > heap ? peak_rss - heap : 0;
+		est = estimate_for(default_hpage_size);
+		est->private += ALIGN(heap, default_hpage_size) /
+					default_hpage_size;
+		printf("Heap %lu bytes %ld byte pages: %lu\n", heap,
+			default_hpage_size,
+			ALIGN(heap, default_hpage_size) / default_hpage_size);
+	}
+
+	if (!nr_estimates) {
+		printf("No segments would be remapped into huge pages\n");
+		return;
+	}
+
+	printf("\nPages needed for %ld process%s:\n", processes,
+		processes > 1 ? "es" : "");
+	for (i = 0; i < nr_estimates; i++) {
+		total = estimates[i].shared + processes * estimates[i].private;
+		printf("  %ld byte pages: %ld shared + %ld per process = %ld\n",
+			estimates[i].page_size, estimates[i].shared,
+			estimates[i].private, total);
+	}
+
+	printf("\nSuggested pool configuration:\n");
+	for (i = 0; i < nr_estimates; i++)
+		printf("  hugeadm --pool-pages-min %ld:%ld\n",
+			estimates[i].page_size, estimates[i].shared +
+				processes * estimates[i].private);
+}
+
+/*
+ * --analyze walks a directory tree and reports, for every executable in
+ * it, how much huge pages could help and what they would cost, so that
+ * the binaries worth relinking with ld.hugetlbfs can be picked out.
+ * Binaries are sorted by the number of iTLB entries huge page text
+ * would save.
+ */
+#define MAX_PAGE_SIZES	4
+
+static long page_sizes[MAX_PAGE_SIZES];
+static int nr_page_sizes;
+
+struct binary_report {
+	int valid;		/* An executable that was analyzed */
+	int aligned;		/* Segments aligned for huge pages */
+	int needs_lib;		/* DT_NEEDED includes libhugetlbfs */
+	int flagged;		/* Some segment has PF_LINUX_HUGETLB */
+	unsigned long text;	/* Bytes in read-only segments */
+	unsigned long data;	/* Bytes in writable segments */
+	long itlb_saved;	/* Text base pages minus text huge pages */
+	long pages[MAX_PAGE_SIZES];
+	unsigned long waste[MAX_PAGE_SIZES];
+};
+
+static char **analyze_paths;
+static size_t nr_analyze_paths, max_analyze_paths;
+
+static void read_page_sizes(void)
+{
+	struct dirent *ent;
+	long size;
+	DIR *dir;
+
+	dir = opendir("/sys/kernel/mm/hugepages");
+	if (dir) {
+		while ((ent = readdir(dir)) && nr_page_sizes < MAX_PAGE_SIZES)
+			if (sscanf(ent->d_name, "hugepages-%ldkB", &size) == 1)
+				page_sizes[nr_page_sizes++] = size * 1024;
+		closedir(dir);
+	}
+	if (!nr_page_sizes)
+		page_sizes[nr_page_sizes++] = default_hpage_size;
+}
+
+static int collect_binary(const char *path, const struct stat *st, int type,
+			  struct FTW *ftw)
+{
+	if (type != FTW_F || !S_ISREG(st->st_mode) ||
+	    !(st->st_mode & 0111) || st->st_size < (off_t)sizeof(Elf32_Ehdr))
+		return 0;
+
+	if (nr_analyze_paths == max_analyze_paths) {
+		max_analyze_paths = max_analyze_paths ? max_analyze_paths * 2 :
+							1024;
+		analyze_paths = realloc(analyze_paths, max_analyze_paths *
+						sizeof(*analyze_paths));
+		if (!analyze_paths) {
+			ERROR("Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	analyze_paths[nr_analyze_paths] = strdup(path);
+	if (!analyze_paths[nr_analyze_paths]) {
+		ERROR("Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	nr_analyze_paths++;
+	return 0;
+}
+
+/*
+ * A binary is treated as linked for huge pages when every PT_LOAD is
+ * aligned to the default huge page size, as --hugetlbfs-align does, and
+ * libhugetlbfs is among its DT_NEEDED libraries.
+ */
+#define analyze_phdrs(_BITS_)						\
+void analyze_phdrs##_BITS_(Elf##_BITS_##_Ehdr *ehdr, unsigned long size, \
+		struct binary_report *r)				\
+{									\
+	Elf##_BITS_##_Phdr *phdr, *dyn = NULL;				\
+	Elf##_BITS_##_Dyn *d;						\
+	unsigned long start, end, strtab = 0, off;			\
+	long base = getpagesize();					\
+	size_t len;							\
+	char *name;							\
+	int i, j, interp = 0;						\
+									\
+	if (ehdr->e_phoff + ehdr->e_phnum * sizeof(*phdr) > size)	\
+		return;							\
+	phdr = (Elf##_BITS_##_Phdr *)((char *)ehdr + ehdr->e_phoff);	\
+									\
+	r->aligned = 1;							\
+	for (i = 0; i < ehdr->e_phnum; i++) {				\
+		if (phdr[i].p_type == PT_INTERP)			\
+			interp = 1;					\
+		if (phdr[i].p_type == PT_DYNAMIC)			\
+			dyn = &phdr[i];					\
+		if (phdr[i].p_type != PT_LOAD)				\
+			continue;					\
+									\
+		if (phdr[i].p_flags & PF_W)				\
+			r->data += phdr[i].p_memsz;			\
+		else							\
+			r->text += phdr[i].p_memsz;			\
+		if (phdr[i].p_flags & PF_LINUX_HUGETLB)			\
+			r->flagged = 1;					\
+		if (phdr[i].p_align < (unsigned long)default_hpage_size) \
+			r->aligned = 0;					\
+									\
+		for (j = 0; j < nr_page_sizes; j++) {			\
+			start = ALIGN_DOWN(phdr[i].p_vaddr,		\
+					page_sizes[j]);			\
+			end = ALIGN(phdr[i].p_vaddr + phdr[i].p_memsz,	\
+					page_sizes[j]);			\
+			r->pages[j] += (end - start) / page_sizes[j];	\
+			r->waste[j] += end - start - phdr[i].p_memsz;	\
+			if (page_sizes[j] == default_hpage_size &&	\
+			    !(phdr[i].p_flags & PF_W))			\
+				r->itlb_saved -= (end - start) /	\
+						page_sizes[j];		\
+		}							\
+	}								\
+	r->itlb_saved += ALIGN(r->text, base) / base;			\
+									\
+	/* Shared libraries have no interpreter */			\
+	if (ehdr->e_type != ET_EXEC && !interp)				\
+		return;							\
+	r->valid = 1;							\
+									\
+	if (!dyn || dyn->p_offset + dyn->p_filesz > size)		\
+		return;							\
+	d = (Elf##_BITS_##_Dyn *)((char *)ehdr + dyn->p_offset);	\
+	for (i = 0; d[i].d_tag != DT_NULL &&				\
+		    (char *)&d[i + 1] <= (char *)ehdr + size; i++)	\
+		if (d[i].d_tag == DT_STRTAB)				\
+			strtab = d[i].d_un.d_ptr;			\
+									\
+	/* DT_STRTAB is an address; find where it is in the file */	\
+	for (i = 0; strtab && i < ehdr->e_phnum; i++) {			\
+		if (phdr[i].p_type != PT_LOAD ||			\
+		    strtab < phdr[i].p_vaddr ||				\
+		    strtab >= phdr[i].p_vaddr + phdr[i].p_filesz)	\
+			continue;					\
+		off = strtab - phdr[i].p_vaddr + phdr[i].p_offset;	\
+		for (j = 0; d[j].d_tag != DT_NULL &&			\
+			    (char *)&d[j + 1] <= (char *)ehdr + size; j++) { \
+			if (d[j].d_tag != DT_NEEDED ||			\
+			    off + d[j].d_un.d_val >= size)		\
+				continue;				\
+			/* The name may run to the end of the file */	\
+			name = (char *)ehdr + off + d[j].d_un.d_val;	\
+			len = strnlen(name, size - off - d[j].d_un.d_val); \
+			if (memmem(name, len, "libhugetlbfs",		\
+				   strlen("libhugetlbfs")))		\
+				r->needs_lib = 1;			\
+		}							\
+		break;							\
+	}								\
+}
+analyze_phdrs(32)
+analyze_phdrs(64)
+
+static void analyze_binary(const char *path, struct binary_report *r)
+{
+	struct stat st;
+	void *ehdr;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(Elf64_Ehdr)) {
+		close(fd);
+		return;
+	}
+	ehdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ehdr == MAP_FAILED)
+		return;
+
+	if (!strncmp(ehdr, ELFMAG, SELFMAG)) {
+		if (((char *)ehdr)[EI_CLASS] == ELFCLASS64)
+			analyze_phdrs64(ehdr, st.st_size, r);
+		else if (((char *)ehdr)[EI_CLASS] == ELFCLASS32)
+			analyze_phdrs32(ehdr, st.st_size, r);
+	}
+	munmap(ehdr, st.st_size);
+}
+
+static struct binary_report *sort_reports;
+
+static int compare_reports(const void *a, const void *b)
+{
+	const struct binary_report *ra = &sort_reports[*(const size_t *)a];
+	const struct binary_report *rb = &sort_reports[*(const size_t *)b];
+
+	if (ra->itlb_saved != rb->itlb_saved)
+		return ra->itlb_saved < rb->itlb_saved ? 1 : -1;
+	return 0;
+}
+
+/*
+ * Each worker analyzes every jobs'th binary and writes its report into a
+ * shared mapping, so no results need to be passed back.
+ */
+void analyze(const char *dir, long jobs)
+{
+	struct binary_report *reports;
+	size_t i, *order, nr_valid = 0, nr_unlinked = 0;
+	long job;
+	int j, status, nr_failed = 0;
+	pid_t pid;
+
+	read_page_sizes();
+	if (nftw(dir, collect_binary, 64, FTW_PHYS) < 0) {
+		ERROR("Walking %s failed: %s\n", dir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (!nr_analyze_paths) {
+		printf("No executable files found in %s\n", dir);
+		return;
+	}
+
+	reports = mmap(NULL, nr_analyze_paths * sizeof(*reports),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	order = malloc(nr_analyze_paths * sizeof(*order));
+	if (reports == MAP_FAILED || !order) {
+		ERROR("Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (jobs > (long)nr_analyze_paths)
+		jobs = nr_analyze_paths;
+	for (job = 0; job < jobs; job++) {
+		pid = fork();
+		if (pid < 0) {
+			ERROR("fork failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (pid == 0) {
+			for (i = job; i < nr_analyze_paths; i += jobs)
+				analyze_binary(analyze_paths[i], &reports[i]);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	while ((pid = wait(&status)) > 0) {
+		if (WIFSIGNALED(status)) {
+			ERROR("Worker %d killed by signal %d\n", pid,
+				WTERMSIG(status));
+			nr_failed++;
+		} else if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+			ERROR("Worker %d exited with status %d\n", pid,
+				WEXITSTATUS(status));
+			nr_failed++;
+		}
+	}
+
+	for (i = 0; i < nr_analyze_paths; i++)
+		if (reports[i].valid)
+			order[nr_valid++] = i;
+	sort_reports = reports;
+	qsort(order, nr_valid, sizeof(*order), compare_reports);
+
+	printf("%10s %12s %12s", "iTLB saved", "text", "data");
+	for (j = 0; j < nr_page_sizes; j++)
+		printf(" %10ldkB %10s", page_sizes[j] / 1024, "waste");
+	printf(" %-8s %s\n", "linked", "binary");
+
+	for (i = 0; i < nr_valid; i++) {
+		struct binary_report *r = &reports[order[i]];
+		const char *linked;
+
+		if (r->aligned && r->needs_lib)
+			linked = "yes";
+		else if (r->aligned)
+			linked = "aligned";
+		else
+			linked = "no";
+		if (strcmp(linked, "yes"))
+			nr_unlinked++;
+
+		printf("%10ld %12lu %12lu", r->itlb_saved, r->text, r->data);
+		for (j = 0; j < nr_page_sizes; j++)
+			printf(" %12ld %10lu", r->pages[j], r->waste[j]);
+		printf(" %-8s %s%s\n", linked, analyze_paths[order[i]],
+			r->flagged ? " (flagged)" : "");
+	}
+
+	printf("\n%zu executables analyzed, %zu not linked for huge pages\n",
+		nr_valid, nr_unlinked);
+	munmap(reports, nr_analyze_paths * sizeof(*reports));
+	free(order);
+
+	if (nr_failed) {
+		ERROR("%d of %ld workers failed, the report is incomplete\n",
+			nr_failed, jobs);
+		exit(EXIT_FAILURE);
+	}
+}
+
 int main(int argc, char ** argv)
 {
 	char opts[] = "+h";
@@ -164,9 +806,20 @@ int main(int argc, char ** argv)
 		{"disable",	no_argument, NULL, MAP_BASE|MAP_DISABLE},
 		{"text",	no_argument, NULL, MAP_BASE|MAP_TEXT},
 		{"data",	no_argument, NULL, MAP_BASE|MAP_DATA},
+		{"estimate",	optional_argument, NULL, EST_BASE|EST_ESTIMATE},
+		{"share",	no_argument, NULL, EST_BASE|EST_SHARE},
+		{"peak-rss",	required_argument, NULL, EST_BASE|EST_PEAK_RSS},
+		{"processes",	required_argument, NULL, EST_BASE|EST_PROCESSES},
+		{"analyze",	no_argument, NULL, EST_BASE|EST_ANALYZE},
+		{"jobs",	required_argument, NULL, EST_BASE|EST_JOBS},
 		{0},
 	};
 	int ret = 0, index = 0, remap_opts = 0;
+	int opt_estimate = 0, opt_analyze = 0;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	char *opt_elfmap = NULL;
+	long peak_rss = 0, processes = 1;
+	struct stat st;
 	int fd;
 	const char *target;
 	void *ehdr;
@@ -187,6 +840,43 @@ int main(int argc, char ** argv)
 			print_usage();
 			exit(EXIT_SUCCESS);
 
+		case EST_BASE|EST_ESTIMATE:
+			opt_estimate = 1;
+			opt_elfmap = optarg;
+			break;
+
+		case EST_BASE|EST_SHARE:
+			opt_share = 1;
+			break;
+
+		case EST_BASE|EST_PEAK_RSS:
+			peak_rss = parse_size(optarg);
+			if (peak_rss <= 0) {
+				ERROR("Invalid peak RSS %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case EST_BASE|EST_PROCESSES:
+			processes = atol(optarg);
+			if (processes <= 0) {
+				ERROR("Invalid process count %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case EST_BASE|EST_ANALYZE:
+			opt_analyze = 1;
+			break;
+
+		case EST_BASE|EST_JOBS:
+			jobs = atol(optarg);
+			if (jobs <= 0) {
+				ERROR("Invalid job count %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		default:
 			ret = -1;
 			break;
@@ -199,12 +889,63 @@ int main(int argc, char ** argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (opt_analyze && (opt_estimate || remap_opts)) {
+		ERROR("--analyze is not compatible with --estimate, --text, "
+			"--data or --disable\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (opt_estimate && remap_opts) {
+		ERROR("--estimate is not compatible with --text, --data or "
+			"--disable\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if ((argc - index) != 1) {
 		print_usage();
 		exit(EXIT_FAILURE);
 	}
 	target = argv[index];
 
+	if (opt_analyze) {
+		default_hpage_size = read_default_hpage_size();
+		if (default_hpage_size <= 0) {
+			ERROR("Unable to find the default huge page size\n");
+			exit(EXIT_FAILURE);
+		}
+		analyze(target, jobs > 0 ? jobs : 1);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (opt_estimate) {
+		default_hpage_size = read_default_hpage_size();
+		if (default_hpage_size <= 0) {
+			ERROR("Unable to find the default huge page size\n");
+			exit(EXIT_FAILURE);
+		}
+		if (opt_elfmap)
+			parse_elfmap(opt_elfmap);
+
+		/* Section headers and symbols are needed too, map it all */
+		fd = open(target, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st)) {
+			ERROR("Opening %s failed: %s\n", target,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		ehdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ehdr == MAP_FAILED) {
+			ERROR("Mapping %s failed: %s\n", target,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		estimate(ehdr, st.st_size, check_elf_wordsize(ehdr),
+			 peak_rss, processes);
+		munmap(ehdr, st.st_size);
+		close(fd);
+		exit(EXIT_SUCCESS);
+	}
+
 	/* We don't need write access unless we plan to alter the binary */
 	fd = open(target, (remap_opts ? O_RDWR : O_RDONLY));
 	if (fd < 0) {
@@ -42,11 +42,17 @@ int hugetlbfs_unlinked_fd_for_size(long page_size);
 /*
  * Direct hugepage allocation flags and types
  *
- * GHP_DEFAULT - Use the default hugepage size to back the region
+ * GHP_DEFAULT    - Use the default hugepage size to back the region
+ * GHP_DONTFORK   - Do not map the region in children after fork()
+ * GHP_WIPEONFORK - Children see the region zero-filled after fork()
+ * GHP_DONTDUMP   - Leave the region out of core dumps
  */
 typedef unsigned long ghp_t;
 #define GHP_DEFAULT	((ghp_t)0x01UL)
-#define GHP_MASK	(GHP_DEFAULT)
+#define GHP_DONTFORK	((ghp_t)0x02UL)
+#define GHP_WIPEONFORK	((ghp_t)0x04UL)
+#define GHP_DONTDUMP	((ghp_t)0x08UL)
+#define GHP_MASK	(GHP_DEFAULT|GHP_DONTFORK|GHP_WIPEONFORK|GHP_DONTDUMP)
 
 /* Direct alloc functions for hugepages */
 void *get_huge_pages(size_t len, ghp_t flags);
@@ -63,17 +69,39 @@ void free_huge_pages(void *ptr);
  * GHP_COLOR    - Use bytes wasted due to alignment to offset the buffer
  *		  by a random cache line. This gives better average
  *		  performance with many buffers
+ * GHR_DONTFORK, GHR_WIPEONFORK, GHR_DONTDUMP
+ *		- As the GHP_ flags of the same names
  */
 typedef unsigned long ghr_t;
+#define GHR_DONTFORK	((ghr_t)0x01000000U)
+#define GHR_WIPEONFORK	((ghr_t)0x02000000U)
+#define GHR_DONTDUMP	((ghr_t)0x04000000U)
 #define GHR_STRICT	((ghr_t)0x10000000U)
 #define GHR_FALLBACK	((ghr_t)0x20000000U)
 #define GHR_COLOR	((ghr_t)0x40000000U)
 #define GHR_DEFAULT	(GHR_FALLBACK|GHR_COLOR)
 
-#define GHR_MASK	(GHR_FALLBACK|GHR_STRICT|GHR_COLOR)
+#define GHR_MASK	(GHR_FALLBACK|GHR_STRICT|GHR_COLOR|GHR_DONTFORK|\
+			 GHR_WIPEONFORK|GHR_DONTDUMP)
 
 /* Allocation functions for regions backed by hugepages */
 void *get_hugepage_region(size_t len, ghr_t flags);
 void free_hugepage_region(void *ptr);
 
+/*
+ * Regions for generated code, mapped once writable and once executable
+ * so that no page is ever both.  See get_hugepage_code_region(3).
+ */
+struct hugepage_code_region;
+struct hugepage_code_region *get_hugepage_code_region(size_t len,
+						      ghr_t flags);
+void *hugepage_code_alloc(struct hugepage_code_region *region, size_t len,
+			  size_t align, void **exec);
+void hugepage_code_sync(struct hugepage_code_region *region, void *exec,
+			size_t len);
+void free_hugepage_code_region(struct hugepage_code_region *region);
+
+/* Move the program's read-only segments to hugepages after startup */
+int hugetlbfs_remap_segments(const char *elfmap);
+
 #endif /* _HUGETLBFS_H */
@@ -36,6 +36,7 @@
 #include <fcntl.h>
 #include <sys/vfs.h>
 #include <sys/statfs.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/file.h>
@@ -44,6 +45,7 @@
 #include <linux/types.h>
 #include <linux/unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "libhugetlbfs_internal.h"
 #include "hugetlbfs.h"
@@ -279,6 +281,43 @@ static char *get_exe_name(char *buf, int size)
 }
 
 
+/*
+ * Parse a comma separated list of dontfork, wipeonfork and dontdump,
+ * ignoring any that do not make sense for the memory var applies to.
+ */
+static unsigned int parse_hints(const char *var, const char *env,
+				unsigned int allowed)
+{
+	static const struct {
+		const char *name;
+		unsigned int hint;
+	} names[] = {
+		{ "dontfork",	HINT_DONTFORK },
+		{ "wipeonfork",	HINT_WIPEONFORK },
+		{ "dontdump",	HINT_DONTDUMP },
+	};
+	unsigned int hints = 0;
+	const char *p, *end;
+	size_t len, i, nr = sizeof(names) / sizeof(names[0]);
+
+	for (p = env; *p; p = *end ? end + 1 : end) {
+		end = strchrnul(p, ',');
+		len = end - p;
+		for (i = 0; i < nr; i++)
+			if (strlen(names[i].name) == len &&
+			    !strncasecmp(p, names[i].name, len))
+				break;
+		if (i == nr)
+			WARNING("%s: unknown hint %.*s\n", var, (int)len, p);
+		else if (!(names[i].hint & allowed))
+			WARNING("%s: %s is not supported here\n", var,
+				names[i].name);
+		else
+			hints |= names[i].hint;
+	}
+	return hints;
+}
+
 /*
  * Reads the contents of hugetlb environment variables and save their
  * values for later use.
@@ -289,17 +328,20 @@ void hugetlbfs_setup_env()
 
 	__hugetlb_opts.min_copy = true;
 
-	env = getenv("HUGETLB_VERBOSE");
+	/* Settings not in the environment may come from the policy file */
+	hugetlbfs_load_policy();
+
+	env = hugetlbfs_getenv("HUGETLB_VERBOSE");
 	if (env)
 		__hugetlbfs_verbose = atoi(env);
 
-	env = getenv("HUGETLB_DEBUG");
+	env = hugetlbfs_getenv("HUGETLB_DEBUG");
 	if (env) {
 		__hugetlbfs_debug = true;
 		__hugetlbfs_verbose = VERBOSE_DEBUG;
 	}
 
-	env = getenv("HUGETLB_RESTRICT_EXE");
+	env = hugetlbfs_getenv("HUGETLB_RESTRICT_EXE");
 	if (env) {
 		char *p, *tok, *exe, buf[MAX_EXE+1], restriction[MAX_EXE];
 		int found = 0;
@@ -322,18 +364,26 @@ void hugetlbfs_setup_env()
 		}
 	}
 
-	env = getenv("HUGETLB_NO_PREFAULT");
+	env = hugetlbfs_getenv("HUGETLB_NO_PREFAULT");
 	if (env)
 		__hugetlbfs_prefault = false;
 
-	__hugetlb_opts.share_path = getenv("HUGETLB_SHARE_PATH");
-	__hugetlb_opts.elfmap = getenv("HUGETLB_ELFMAP");
+	__hugetlb_opts.share_path = hugetlbfs_getenv("HUGETLB_SHARE_PATH");
+	__hugetlb_opts.elfmap = hugetlbfs_getenv("HUGETLB_ELFMAP");
 	__hugetlb_opts.ld_preload = getenv("LD_PRELOAD");
-	__hugetlb_opts.def_page_size = getenv("HUGETLB_DEFAULT_PAGE_SIZE");
-	__hugetlb_opts.path = getenv("HUGETLB_PATH");
-	__hugetlb_opts.features = getenv("HUGETLB_FEATURES");
-	__hugetlb_opts.morecore = getenv("HUGETLB_MORECORE");
-	__hugetlb_opts.heapbase = getenv("HUGETLB_MORECORE_HEAPBASE");
+	__hugetlb_opts.def_page_size =
+		hugetlbfs_getenv("HUGETLB_DEFAULT_PAGE_SIZE");
+	__hugetlb_opts.path = hugetlbfs_getenv("HUGETLB_PATH");
+	__hugetlb_opts.features = hugetlbfs_getenv("HUGETLB_FEATURES");
+	__hugetlb_opts.morecore = hugetlbfs_getenv("HUGETLB_MORECORE");
+	__hugetlb_opts.heapbase =
+		hugetlbfs_getenv("HUGETLB_MORECORE_HEAPBASE");
+	__hugetlb_opts.heap_growth =
+		hugetlbfs_getenv("HUGETLB_MORECORE_GROWTH");
+	__hugetlb_opts.heap_reserve =
+		hugetlbfs_getenv("HUGETLB_MORECORE_RESERVE");
+	__hugetlb_opts.trim_keep =
+		hugetlbfs_getenv("HUGETLB_MORECORE_TRIM_KEEP");
 
 	if (__hugetlb_opts.morecore)
 		__hugetlb_opts.thp_morecore =
@@ -344,18 +394,18 @@ void hugetlbfs_setup_env()
 		__hugetlb_opts.heapbase = NULL;
 	}
 
-	env = getenv("HUGETLB_FORCE_ELFMAP");
+	env = hugetlbfs_getenv("HUGETLB_FORCE_ELFMAP");
 	if (env && (strcasecmp(env, "yes") == 0))
 		__hugetlb_opts.force_elfmap = 1;
 
-	env = getenv("HUGETLB_MINIMAL_COPY");
+	env = hugetlbfs_getenv("HUGETLB_MINIMAL_COPY");
 	if (__hugetlb_opts.min_copy && env && (strcasecmp(env, "no") == 0)) {
 		INFO("HUGETLB_MINIMAL_COPY=%s, disabling filesz copy "
 			"optimization\n", env);
 		__hugetlb_opts.min_copy = false;
 	}
 
-	env = getenv("HUGETLB_SHARE");
+	env = hugetlbfs_getenv("HUGETLB_SHARE");
 	if (env)
 		__hugetlb_opts.sharing = atoi(env);
 
@@ -374,19 +424,82 @@ void hugetlbfs_setup_env()
 	 * This behavior has been reported to the ptmalloc2 maintainer,
 	 * along with a patch to correct the behavior.
 	 */
-	env = getenv("HUGETLB_MORECORE_SHRINK");
+	env = hugetlbfs_getenv("HUGETLB_MORECORE_SHRINK");
 	if (env && strcasecmp(env, "yes") == 0)
 		__hugetlb_opts.shrink_ok = true;
+	if (env && strcasecmp(env, "lazy") == 0)
+		__hugetlb_opts.shrink_ok = __hugetlb_opts.shrink_lazy = true;
+
+	/* Seconds the heap must stay small before lazy shrinking trims it */
+	__hugetlb_opts.trim_delay = 5;
+	env = hugetlbfs_getenv("HUGETLB_MORECORE_TRIM_DELAY");
+	if (env)
+		__hugetlb_opts.trim_delay = strtoul(env, NULL, 10);
+
+	/* Determine if the heap may continue elsewhere when blocked */
+	env = hugetlbfs_getenv("HUGETLB_MORECORE_NONCONTIG");
+	if (env && strcasecmp(env, "yes") == 0)
+		__hugetlb_opts.heap_noncontig = true;
+
+	/* Determine if the heap may continue on THP without huge pages */
+	env = hugetlbfs_getenv("HUGETLB_MORECORE_FALLBACK");
+	if (env && strcasecmp(env, "thp") == 0)
+		__hugetlb_opts.heap_thp_fallback = true;
 
 	/* Determine if shmget() calls should be overridden */
-	env = getenv("HUGETLB_SHM");
+	env = hugetlbfs_getenv("HUGETLB_SHM");
 	if (env && !strcasecmp(env, "yes"))
 		__hugetlb_opts.shm_enabled = true;
 
 	/* Determine if all reservations should be avoided */
-	env = getenv("HUGETLB_NO_RESERVE");
+	env = hugetlbfs_getenv("HUGETLB_NO_RESERVE");
 	if (env && !strcasecmp(env, "yes"))
 		__hugetlb_opts.no_reserve = true;
+
+	/* Determine if freeing should be deferred, and for how long (ms) */
+	env = hugetlbfs_getenv("HUGETLB_DEFERRED_FREE");
+	if (env) {
+		if (!strcasecmp(env, "yes"))
+			__hugetlb_opts.deferred_free = 10;
+		else if (strcasecmp(env, "no"))
+			__hugetlb_opts.deferred_free = strtoul(env, NULL, 10);
+	}
+
+	/*
+	 * Hints for the heap and segments.  A child that lost or wiped the
+	 * heap would be left with a malloc arena pointing at nothing, and
+	 * segments hold the program itself, so both may only be left out
+	 * of core dumps.
+	 */
+	env = hugetlbfs_getenv("HUGETLB_MORECORE_HINTS");
+	if (env)
+		__hugetlb_opts.heap_hints = parse_hints("HUGETLB_MORECORE_HINTS",
+					env, HINT_DONTDUMP);
+	env = hugetlbfs_getenv("HUGETLB_ELFMAP_HINTS");
+	if (env)
+		__hugetlb_opts.segment_hints = parse_hints("HUGETLB_ELFMAP_HINTS",
+					env, HINT_DONTDUMP);
+
+	/* Determine if the THP heap is collapsed in-process, how fast (MB/s) */
+	env = hugetlbfs_getenv("HUGETLB_MORECORE_COLLAPSE");
+	if (env) {
+		if (!strcasecmp(env, "yes"))
+			__hugetlb_opts.thp_collapse = 64;
+		else if (strcasecmp(env, "no"))
+			__hugetlb_opts.thp_collapse = strtoul(env, NULL, 10);
+	}
+
+	/* Determine if the mount cache written by hugeadm may be used */
+	env = hugetlbfs_getenv("HUGETLB_MOUNT_CACHE");
+	if (env && !strcasecmp(env, "no"))
+		__hugetlb_opts.no_mount_cache = true;
+	if (env && !strcasecmp(env, "yes"))
+		__hugetlb_opts.force_mount_cache = true;
+
+	/* Determine if kernel features must be probed afresh */
+	env = hugetlbfs_getenv("HUGETLB_FEATURE_CACHE");
+	if (env && !strcasecmp(env, "no"))
+		__hugetlb_opts.no_feature_cache = true;
 }
 
 void hugetlbfs_setup_kernel_page_size()
@@ -563,24 +676,9 @@ void probe_default_hpage_size(void)
 	}
 }
 
-static void add_hugetlbfs_mount(char *path, int user_mount)
+static void add_hugetlbfs_mount_size(char *path, long size, int user_mount)
 {
 	int idx;
-	long size;
-
-	if (strlen(path) > PATH_MAX)
-		return;
-
-	if (!hugetlbfs_test_path(path)) {
-		WARNING("%s is not a hugetlbfs mount point, ignoring\n", path);
-		return;
-	}
-
-	size = hugetlbfs_test_pagesize(path);
-	if (size < 0) {
-		WARNING("Unable to detect page size for path %s\n", path);
-		return;
-	}
 
 	idx = hpage_size_to_index(size);
 	if (idx < 0) {
@@ -604,6 +702,40 @@ static void add_hugetlbfs_mount(char *path, int user_mount)
 	strcpy(hpage_sizes[idx].mount, path);
 }
 
+/*
+ * Return the page size of a hugetlbfs mount, or -1 if path is not one.
+ * Both facts come from a single statfs64() (see hugetlbfs_test_path()
+ * for why statfs64 is used).
+ */
+static long hugetlbfs_mount_pagesize(const char *path)
+{
+	struct statfs64 sb;
+
+	if (statfs64(path, &sb) || sb.f_type != HUGETLBFS_MAGIC)
+		return -1;
+	if ((sb.f_bsize <= 0) || (sb.f_bsize > LONG_MAX))
+		return -1;
+	return sb.f_bsize;
+}
+
+static void add_hugetlbfs_mount(char *path, int user_mount)
+{
+	long size;
+
+	if (strlen(path) > PATH_MAX)
+		return;
+
+	size = hugetlbfs_mount_pagesize(path);
+	if (size < 0) {
+		if (user_mount)
+			WARNING("%s is not a hugetlbfs mount point, "
+				"ignoring\n", path);
+		return;
+	}
+
+	add_hugetlbfs_mount_size(path, size, user_mount);
+}
+
 void debug_show_page_sizes(void)
 {
 	int i;
@@ -617,61 +749,449 @@ void debug_show_page_sizes(void)
 }
 
 #define LINE_MAXLEN	2048
-static void find_mounts(void)
+#define MOUNTS_BUFSZ	16384
+
+/* Undo the octal escaping (\040 etc.) the kernel applies to mount paths */
+static void unescape_mount_path(char *path)
+{
+	char *in, *out;
+
+	for (in = out = path; *in; in++, out++) {
+		if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' &&
+		    in[2] >= '0' && in[2] <= '7' &&
+		    in[3] >= '0' && in[3] <= '7') {
+			*out = ((in[1] - '0') << 6) | ((in[2] - '0') << 3) |
+				(in[3] - '0');
+			in += 3;
+		} else {
+			*out = *in;
+		}
+	}
+	*out = '\0';
+}
+
+/*
+ * Call fn() for the mount point of every hugetlbfs filesystem in the
+ * mount table.  The table is read in large chunks and parsed in place
+ * in a single pass; a line split across two reads is carried over to
+ * the start of the buffer.  Hosts with tens of thousands of mounts
+ * would otherwise pay a read() and lseek() per line.
+ */
+static int for_each_hugetlbfs_mount(void (*fn)(char *path, void *data),
+				    void *data)
 {
 	int fd;
+	char buf[MOUNTS_BUFSZ + 1];
 	char path[PATH_MAX+1];
-	char line[LINE_MAXLEN + 1];
-	char *eol;
-	char *match;
-	char *end;
-	int bytes;
-	off_t offset;
+	char *line, *eol, *match, *end;
+	ssize_t bytes;
+	size_t len = 0;
 
-	fd = open("/proc/mounts", O_RDONLY);
+	fd = open("/proc/self/mounts", O_RDONLY);
+	if (fd < 0)
+		fd = open("/proc/mounts", O_RDONLY);
 	if (fd < 0) {
 		fd = open("/etc/mtab", O_RDONLY);
 		if (fd < 0) {
 			ERROR("Couldn't open /proc/mounts or /etc/mtab (%s)\n",
 				strerror(errno));
-			return;
+			return -1;
 		}
 	}
 
-	while ((bytes = read(fd, line, LINE_MAXLEN)) > 0) {
-		line[LINE_MAXLEN] = '\0';
-		eol = strchr(line, '\n');
-		if (!eol) {
+	while ((bytes = read(fd, buf + len, MOUNTS_BUFSZ - len)) > 0) {
+		len += bytes;
+		buf[len] = '\0';
+
+		line = buf;
+		while ((eol = strchr(line, '\n')) != NULL) {
+			*eol = '\0';
+
+			/* Match only hugetlbfs filesystems. */
+			match = strstr(line, " hugetlbfs ");
+			if (match) {
+				/* The mount point is the second field */
+				match = strchr(line, ' ');
+				end = strchr(match + 1, ' ');
+				if (end && end - match - 1 <= PATH_MAX) {
+					strncpy(path, match + 1, end - match - 1);
+					path[end - match - 1] = '\0';
+					unescape_mount_path(path);
+					fn(path, data);
+				}
+			}
+			line = eol + 1;
+		}
+
+		/* Keep the partial line for the next read */
+		len -= line - buf;
+		if (len == MOUNTS_BUFSZ) {
 			ERROR("Line too long when parsing mounts\n");
 			break;
 		}
+		memmove(buf, line, len);
+	}
+	close(fd);
+	return 0;
+}
 
-		/*
-		 * Truncate the string to just one line and reset the file
-		 * to begin reading at the start of the next line.
-		 */
-		*eol = '\0';
-		offset = bytes - (eol + 1 - line);
-		lseek(fd, -offset, SEEK_CUR);
-
-		/* Match only hugetlbfs filesystems. */
-		match = strstr(line, " hugetlbfs ");
-		if (match) {
-			match = strchr(line, '/');
-			if (!match)
-				continue;
-			end = strchr(match, ' ');
-			if (!end)
+static void find_mount(char *path, void *data)
+{
+	if (!access(path, R_OK | W_OK | X_OK))
+		add_hugetlbfs_mount(path, 0);
+}
+
+static void find_mounts(void)
+{
+	for_each_hugetlbfs_mount(find_mount, NULL);
+}
+
+/*
+ * Copy this boot's id (from /proc/sys/kernel/random/boot_id) into buf.
+ * Cached state under HUGETLB_RUN_DIR is stamped with it so that a stale
+ * file surviving a reboot on a persistent /run is never trusted.
+ */
+int read_boot_id(char *buf, size_t len)
+{
+	int fd;
+	ssize_t bytes;
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+	if (fd < 0)
+		return -1;
+	bytes = read(fd, buf, len - 1);
+	close(fd);
+	if (bytes <= 0)
+		return -1;
+
+	buf[bytes] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/*
+ * Open a regular file for reading only if it, and the directory holding
+ * it, can only have been written by root.  Anything else could be used
+ * to steer a privileged process at the wrong mount or feature set.
+ */
+int open_trusted_file(const char *path)
+{
+	char dir[PATH_MAX+1];
+	struct stat st;
+	char *slash;
+	int fd;
+
+	strncpy(dir, path, PATH_MAX);
+	dir[PATH_MAX] = '\0';
+	slash = strrchr(dir, '/');
+	if (!slash || slash == dir)
+		return -1;
+	*slash = '\0';
+	if (stat(dir, &st) || st.st_uid != 0 ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)))
+		return -1;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != 0 ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Read a cache file under HUGETLB_RUN_DIR into buf.  The file must be
+ * trusted, start with the given magic line and carry this boot's id.
+ * Returns the entries following that header, or NULL if the cache is
+ * unusable.  Only plain syscalls are used, as this may run before the
+ * morecore hook is in place.
+ */
+char *read_run_cache(const char *path, const char *magic, char *buf,
+		     size_t len)
+{
+	char boot_id[64];
+	size_t mlen = strlen(magic);
+	size_t used = 0;
+	ssize_t bytes;
+	char *line, *eol;
+	int fd;
+
+	if (read_boot_id(boot_id, sizeof(boot_id)))
+		return NULL;
+
+	fd = open_trusted_file(path);
+	if (fd < 0)
+		return NULL;
+	while (used < len - 1 &&
+	       (bytes = read(fd, buf + used, len - 1 - used)) > 0)
+		used += bytes;
+	close(fd);
+	buf[used] = '\0';
+
+	if (strncmp(buf, magic, mlen) || buf[mlen] != '\n')
+		return NULL;
+	line = buf + mlen + 1;
+	eol = strchr(line, '\n');
+	if (!eol)
+		return NULL;
+	*eol = '\0';
+	if (strncmp(line, "boot_id ", 8) || strcmp(line + 8, boot_id)) {
+		DEBUG("%s is from a previous boot\n", path);
+		return NULL;
+	}
+	return eol + 1;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t bytes;
+
+	while (len) {
+		bytes = write(fd, buf, len);
+		if (bytes < 0) {
+			if (errno == EINTR)
 				continue;
+			return -1;
+		}
+		buf += bytes;
+		len -= bytes;
+	}
+	return 0;
+}
+
+/*
+ * Atomically replace a cache file under HUGETLB_RUN_DIR with the magic
+ * line, this boot's id and body.  Returns -1 with errno set on failure
+ * and leaves reporting to the caller.
+ */
+int write_run_cache(const char *path, const char *magic, const char *body)
+{
+	char tmp[PATH_MAX+1], header[128];
+	char boot_id[64];
+	int fd, err;
+
+	if (read_boot_id(boot_id, sizeof(boot_id)))
+		return -1;
+	if (mkdir(HUGETLB_RUN_DIR, 0755) && errno != EEXIST)
+		return -1;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	fchmod(fd, 0644);
+
+	snprintf(header, sizeof(header), "%s\nboot_id %s\n", magic, boot_id);
+	if (write_all(fd, header, strlen(header)) ||
+	    write_all(fd, body, strlen(body))) {
+		err = errno;
+		close(fd);
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	if (close(fd) || rename(tmp, path)) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The mount cache is keyed by mount namespace, since containers see a
+ * different set of hugetlbfs mounts from the host.
+ */
+static int mount_cache_path(char *path, size_t len)
+{
+	char ns[64];
+	ssize_t bytes;
+	char *id;
+
+	bytes = readlink("/proc/self/ns/mnt", ns, sizeof(ns) - 1);
+	if (bytes <= 0)
+		return -1;
+	ns[bytes] = '\0';
+
+	/* "mnt:[4026531840]" */
+	id = strchr(ns, '[');
+	if (!id)
+		return -1;
+	id++;
+	id[strcspn(id, "]")] = '\0';
+
+	if (snprintf(path, len, "%s/mounts.%s", HUGETLB_RUN_DIR, id) >= len)
+		return -1;
+	return 0;
+}
+
+#if !defined(SYS_listmount) && !defined(__alpha__)
+#define SYS_listmount	458
+#endif
+#define LSMT_ROOT	0xffffffffffffffffULL
+
+struct mnt_id_req_v0 {
+	uint32_t size;
+	uint32_t spare;
+	uint64_t mnt_id;
+	uint64_t param;
+};
 
-			strncpy(path, match, end - match);
-			path[end - match] = '\0';
-			if ((hugetlbfs_test_path(path) == 1) &&
-			    !(access(path, R_OK | W_OK | X_OK)))
-				add_hugetlbfs_mount(path, 0);
+/*
+ * Fill ids with up to nr ids of mounts in this namespace newer than
+ * after, in ascending order.  Ids from listmount() are never reused, so
+ * any mount added after one was seen has a larger id.  Returns -1 if
+ * the kernel (before 6.8) cannot list mounts.
+ */
+static long list_mounts_after(uint64_t after, uint64_t *ids, size_t nr)
+{
+#ifdef SYS_listmount
+	struct mnt_id_req_v0 req = { sizeof(req), 0, LSMT_ROOT, after };
+
+	return syscall(SYS_listmount, &req, ids, nr, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* The id of the newest mount in this namespace, 0 if unknown */
+static uint64_t newest_mount_id(void)
+{
+	uint64_t ids[64], newest = 0;
+	long n;
+
+	do {
+		n = list_mounts_after(newest, ids, 64);
+		if (n < 0)
+			return 0;
+		if (n > 0)
+			newest = ids[n - 1];
+	} while (n == 64);
+	return newest;
+}
+
+/*
+ * Use the mount cache written by hugeadm.  Every entry is checked with
+ * statfs so that a mount removed or replaced since the cache was written
+ * invalidates it, and the kernel is asked for any mount newer than the
+ * newest one the cache saw, so that a hugetlbfs mount added by anything
+ * else does too.  Where the kernel cannot say, the cache is only used
+ * with HUGETLB_MOUNT_CACHE=yes.  Returns 0 if the cache was used, -1 if
+ * the mount table must be scanned instead.
+ */
+static int read_mount_cache(void)
+{
+	char path[PATH_MAX+1];
+	char buf[MOUNTS_BUFSZ + 1];
+	char *line, *eol, *mnt;
+	long sizes[MAX_HPAGE_SIZES * 4];
+	char *mounts[MAX_HPAGE_SIZES * 4];
+	uint64_t newest, id;
+	long added;
+	int nr = 0, i;
+
+	if (mount_cache_path(path, sizeof(path)))
+		return -1;
+	line = read_run_cache(path, MOUNT_CACHE_MAGIC, buf, sizeof(buf));
+	if (!line)
+		return -1;
+
+	/* "newest_mount <id>", 0 if the writer could not list mounts */
+	if (strncmp(line, "newest_mount ", 13))
+		return -1;
+	newest = strtoull(line + 13, &eol, 10);
+	if (*eol != '\n')
+		return -1;
+	line = eol + 1;
+	added = newest ? list_mounts_after(newest, &id, 1) : -1;
+	if (added > 0) {
+		DEBUG("Mount cache %s is stale, mounts were added\n", path);
+		return -1;
+	}
+	if (added < 0 && !__hugetlb_opts.force_mount_cache)
+		return -1;
+
+	/* One "<page size> <mount point>" line per mount */
+	for (; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+		*eol = '\0';
+		mnt = strchr(line, ' ');
+		if (!mnt || nr >= MAX_HPAGE_SIZES * 4)
+			return -1;
+		*mnt = '\0';
+		sizes[nr] = atol(line);
+		mounts[nr++] = mnt + 1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (hugetlbfs_mount_pagesize(mounts[i]) != sizes[i]) {
+			DEBUG("Mount cache %s is stale at %s\n", path,
+				mounts[i]);
+			return -1;
 		}
 	}
-	close(fd);
+
+	for (i = 0; i < nr; i++)
+		if (strlen(mounts[i]) <= PATH_MAX &&
+		    !access(mounts[i], R_OK | W_OK | X_OK))
+			add_hugetlbfs_mount_size(mounts[i], sizes[i], 0);
+	DEBUG("Using %d mount(s) from %s\n", nr, path);
+	return 0;
+}
+
+struct mount_cache_buf {
+	char *buf;
+	size_t len;
+	size_t used;
+};
+
+static void cache_mount(char *path, void *data)
+{
+	struct mount_cache_buf *cache = data;
+	long size = hugetlbfs_mount_pagesize(path);
+	int bytes;
+
+	if (size <= 0 || strchr(path, '\n'))
+		return;
+
+	bytes = snprintf(cache->buf + cache->used, cache->len - cache->used,
+			 "%ld %s\n", size, path);
+	if (bytes > 0 && bytes < cache->len - cache->used)
+		cache->used += bytes;
+	else
+		cache->buf[cache->used] = '\0';
+}
+
+/*
+ * Record every hugetlbfs mount in this mount namespace for later
+ * processes to pick up.  Needs root; called by hugeadm whenever it
+ * creates mounts.
+ */
+int write_mount_cache(void)
+{
+	char path[PATH_MAX+1];
+	char buf[MOUNTS_BUFSZ];
+	struct mount_cache_buf cache = { buf, sizeof(buf), 0 };
+
+	if (mount_cache_path(path, sizeof(path))) {
+		ERROR("Unable to identify the mount namespace\n");
+		return -1;
+	}
+
+	/* Taken first, so a mount added while scanning makes the cache stale */
+	cache.used = snprintf(buf, sizeof(buf), "newest_mount %llu\n",
+			      (unsigned long long)newest_mount_id());
+	for_each_hugetlbfs_mount(cache_mount, &cache);
+
+	if (write_run_cache(path, MOUNT_CACHE_MAGIC, buf)) {
+		ERROR("Unable to write %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
 }
 
 void setup_mounts(void)
@@ -698,8 +1218,8 @@ void setup_mounts(void)
 		__hugetlb_opts.path = *next == '\0' ? NULL : next + 1;
 	}
 
-	/* Then probe all mounted filesystems */
-	if (do_scan)
+	/* Then probe all mounted filesystems, via the cache if possible */
+	if (do_scan && (__hugetlb_opts.no_mount_cache || read_mount_cache()))
 		find_mounts();
 }
 
@@ -827,6 +1347,304 @@ int kernel_has_overcommit(void)
 	return 1;
 }
 
+/*
+ * Call fn on each line of a /proc file until it returns non-zero.  The
+ * file is read with plain syscalls into a buffer on the stack, as the
+ * cgroup lookups run from morecore with malloc's locks held.
+ */
+static void for_each_proc_line(const char *file,
+			       int (*fn)(char *line, void *data), void *data)
+{
+	char buf[MOUNTS_BUFSZ + 1];
+	char *line, *eol;
+	ssize_t bytes;
+	size_t len = 0;
+	int fd;
+
+	fd = open(file, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	while ((bytes = read(fd, buf + len, MOUNTS_BUFSZ - len)) > 0) {
+		len += bytes;
+		buf[len] = '\0';
+
+		line = buf;
+		while ((eol = strchr(line, '\n')) != NULL) {
+			*eol = '\0';
+			if (fn(line, data))
+				goto out;
+			line = eol + 1;
+		}
+
+		/* Keep the partial line for the next read */
+		len -= line - buf;
+		if (len == MOUNTS_BUFSZ)
+			break;
+		memmove(buf, line, len);
+	}
+out:
+	close(fd);
+}
+
+/*
+ * Where the unified (v2) cgroup hierarchy is mounted and the cgroup of
+ * this process in it.  Both are looked up once, as neither is expected
+ * to move while we run.
+ */
+static char cgroup2_root[PATH_MAX+1];
+static char hugetlb_cgroup_dir[PATH_MAX+1];
+static pthread_once_t cgroup_once = PTHREAD_ONCE_INIT;
+
+static int find_cgroup2_mount(char *line, void *data)
+{
+	char path[PATH_MAX+1];
+	char fstype[32];
+
+	if (sscanf(line, "%*s %" stringify(PATH_MAX) "s %31s",
+		   path, fstype) != 2 || strcmp(fstype, "cgroup2"))
+		return 0;
+	strcpy(cgroup2_root, path);
+	return 1;
+}
+
+/* The unified hierarchy is the "0::<path>" entry */
+static int find_own_cgroup(char *line, void *data)
+{
+	if (strncmp(line, "0::", 3))
+		return 0;
+	snprintf(hugetlb_cgroup_dir, sizeof(hugetlb_cgroup_dir), "%s%s",
+		 cgroup2_root, strcmp(line + 3, "/") ? line + 3 : "");
+	return 1;
+}
+
+static void probe_cgroup(void)
+{
+	for_each_proc_line("/proc/self/mounts", find_cgroup2_mount, NULL);
+	if (cgroup2_root[0])
+		for_each_proc_line("/proc/self/cgroup", find_own_cgroup, NULL);
+}
+
+/*
+ * Find where the unified (v2) cgroup hierarchy is mounted.
+ */
+const char *cgroup2_mount(void)
+{
+	pthread_once(&cgroup_once, probe_cgroup);
+	return cgroup2_root[0] ? cgroup2_root : NULL;
+}
+
+/*
+ * The hugetlb controller names its files after the page size, e.g.
+ * hugetlb.2MB.max or hugetlb.1GB.rsvd.current.
+ */
+void hugetlb_cgroup_size_name(char *buf, size_t len, long page_size)
+{
+	if (page_size >= 1024L * 1024 * 1024)
+		snprintf(buf, len, "%ldGB", page_size >> 30);
+	else if (page_size >= 1024L * 1024)
+		snprintf(buf, len, "%ldMB", page_size >> 20);
+	else
+		snprintf(buf, len, "%ldKB", page_size >> 10);
+}
+
+/*
+ * Read a hugetlb cgroup file.  Returns -1 for "max" and -2 if the file
+ * cannot be read, which is the case for the root cgroup and for cgroups
+ * without the hugetlb controller enabled.  Some kernels show an unset
+ * limit as the largest page multiple instead of "max".
+ */
+long hugetlb_cgroup_read(const char *dir, long page_size, const char *file)
+{
+	char path[PATH_MAX+1];
+	char size[16];
+	char buf[32];
+	int fd, len;
+	long val;
+
+	hugetlb_cgroup_size_name(size, sizeof(size), page_size);
+	snprintf(path, sizeof(path), "%s/hugetlb.%s.%s", dir, size, file);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -2;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -2;
+	buf[len] = '\0';
+
+	if (strncmp(buf, "max", 3) == 0)
+		return -1;
+	val = strtol(buf, NULL, 10);
+	return val > LONG_MAX - getpagesize() ? -1 : val;
+}
+
+/*
+ * The finite hugetlb limits on this process's cgroup and its ancestors,
+ * for one page size.  Limits rarely change, so they are found once per
+ * process and after that only the usage files are read.  Each limit
+ * records the length of its cgroup's path in hugetlb_cgroup_dir.
+ */
+#define CGROUP_LIMITS_MAX	32
+
+enum { LIMITS_EMPTY, LIMITS_BUILDING, LIMITS_READY, LIMITS_UNCACHED };
+
+static struct cgroup_limits {
+	long page_size;
+	int state;
+	int nr;
+	struct {
+		unsigned short dirlen;
+		unsigned char rsvd;
+		long limit;
+	} limits[CGROUP_LIMITS_MAX];
+} cgroup_limits[MAX_HPAGE_SIZES];
+
+static const char *const cgroup_limit_files[2][2] = {
+	{ "max", "current" },
+	{ "rsvd.max", "rsvd.current" },
+};
+
+/*
+ * Record every finite limit from the cgroup up to the root.  Returns -1
+ * if there are too many to record.
+ */
+static int find_cgroup_limits(struct cgroup_limits *cl, const char *root)
+{
+	char dir[PATH_MAX+1];
+	long limit;
+	char *p;
+	int rsvd;
+
+	cl->nr = 0;
+	strcpy(dir, hugetlb_cgroup_dir);
+	while (strlen(dir) > strlen(root)) {
+		for (rsvd = 0; rsvd < 2; rsvd++) {
+			limit = hugetlb_cgroup_read(dir, cl->page_size,
+						cgroup_limit_files[rsvd][0]);
+			if (limit < 0)
+				continue;
+			if (cl->nr == CGROUP_LIMITS_MAX)
+				return -1;
+			cl->limits[cl->nr].dirlen = strlen(dir);
+			cl->limits[cl->nr].rsvd = rsvd;
+			cl->limits[cl->nr].limit = limit;
+			cl->nr++;
+		}
+
+		p = strrchr(dir, '/');
+		if (!p)
+			break;
+		*p = '\0';
+	}
+	return 0;
+}
+
+/*
+ * The limits for page_size, found on first use.  Returns NULL if they
+ * cannot be cached, in which case the caller looks them up itself.
+ * This may run with malloc's locks held, so it takes no locks: a
+ * thread that finds the entry being filled in does without it.
+ */
+static struct cgroup_limits *get_cgroup_limits(long page_size,
+					       const char *root)
+{
+	struct cgroup_limits *cl;
+	int i, state;
+
+	for (i = 0; i < MAX_HPAGE_SIZES; i++) {
+		cl = &cgroup_limits[i];
+		state = __atomic_load_n(&cl->state, __ATOMIC_ACQUIRE);
+		if (state == LIMITS_EMPTY) {
+			if (!__atomic_compare_exchange_n(&cl->state, &state,
+					LIMITS_BUILDING, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_ACQUIRE))
+				return NULL;
+			cl->page_size = page_size;
+			state = find_cgroup_limits(cl, root) ?
+				LIMITS_UNCACHED : LIMITS_READY;
+			__atomic_store_n(&cl->state, state, __ATOMIC_RELEASE);
+			return state == LIMITS_READY ? cl : NULL;
+		}
+		if (state == LIMITS_BUILDING)
+			return NULL;
+		if (cl->page_size != page_size)
+			continue;
+		return state == LIMITS_READY ? cl : NULL;
+	}
+	return NULL;
+}
+
+/* Lower budget to what is left under one limit; budget -1 is none yet */
+static long cgroup_limit_left(long budget, const char *dir, long page_size,
+			      long limit, int rsvd)
+{
+	long usage, left;
+
+	if (limit < 0)
+		return budget;
+	usage = hugetlb_cgroup_read(dir, page_size,
+				    cgroup_limit_files[rsvd][1]);
+	if (usage < 0)
+		return budget;
+	left = limit > usage ? limit - usage : 0;
+	return budget < 0 || left < budget ? left : budget;
+}
+
+/*
+ * Return how many more bytes of huge pages of the given size the hugetlb
+ * cgroup of this process and its ancestors allow it to use, or -1 if no
+ * limit applies.  Both limits count: the reservation limit decides
+ * whether mmap() succeeds, the fault limit whether touching the pages
+ * later ends in SIGBUS.  Once the limits are known, each call reads one
+ * usage file per finite limit, and none if there are no limits.
+ */
+long hugetlb_cgroup_budget(long page_size)
+{
+	struct cgroup_limits *cl;
+	char dir[PATH_MAX+1];
+	const char *root;
+	long budget = -1;
+	char *p;
+	int i, rsvd;
+
+	root = cgroup2_mount();
+	if (!root || !hugetlb_cgroup_dir[0])
+		return -1;
+
+	cl = get_cgroup_limits(page_size, root);
+	if (cl) {
+		for (i = 0; i < cl->nr; i++) {
+			memcpy(dir, hugetlb_cgroup_dir, cl->limits[i].dirlen);
+			dir[cl->limits[i].dirlen] = '\0';
+			budget = cgroup_limit_left(budget, dir, page_size,
+						   cl->limits[i].limit,
+						   cl->limits[i].rsvd);
+		}
+	} else {
+		strcpy(dir, hugetlb_cgroup_dir);
+		while (strlen(dir) > strlen(root)) {
+			for (rsvd = 0; rsvd < 2; rsvd++)
+				budget = cgroup_limit_left(budget, dir,
+					page_size,
+					hugetlb_cgroup_read(dir, page_size,
+						cgroup_limit_files[rsvd][0]),
+					rsvd);
+
+			p = strrchr(dir, '/');
+			if (!p)
+				break;
+			*p = '\0';
+		}
+	}
+
+	if (budget >= 0)
+		DEBUG("hugetlb cgroup allows %ld more bytes of %ldkB pages\n",
+			budget, page_size / 1024);
+	return budget;
+}
+
 /********************************************************************/
 /* Library user visible functions                                   */
 /********************************************************************/
@@ -845,6 +1663,8 @@ long gethugepagesize(void)
 {
 	long hpage_size;
 
+	hugetlbfs_lazy_init();
+
 	/* Are huge pages available and have they been initialized? */
 	if (hpage_sizes_default_idx == -1) {
 		errno = hugepagesize_errno = ENOSYS;
@@ -984,6 +1804,7 @@ const char *hugetlbfs_find_path_for_size(long page_size)
 	char *path;
 	int idx;
 
+	hugetlbfs_lazy_init();
 	idx = hpage_size_to_index(page_size);
 	if (idx >= 0) {
 		path = hpage_sizes[idx].mount;
@@ -1039,6 +1860,46 @@ int hugetlbfs_unlinked_fd(void)
 		return -1;
 }
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+#ifndef MADV_DONTFORK
+#define MADV_DONTFORK		10
+#endif
+#ifndef MADV_DONTDUMP
+#define MADV_DONTDUMP		16
+#endif
+#ifndef MADV_WIPEONFORK
+#define MADV_WIPEONFORK		18
+#endif
+
+/*
+ * Apply HINT_* flags to a mapping.  Returns the hints the kernel refused;
+ * only a refused MADV_WIPEONFORK is left for the caller to report, as
+ * hugetlb mappings never accept it and callers may emulate it.
+ */
+unsigned int hugetlbfs_madvise_hints(void *addr, size_t length,
+				     unsigned int hints)
+{
+	unsigned int failed = 0;
+
+	if ((hints & HINT_DONTFORK) && madvise(addr, length, MADV_DONTFORK)) {
+		WARNING("MADV_DONTFORK failed for %p: %s\n", addr,
+			strerror(errno));
+		failed |= HINT_DONTFORK;
+	}
+	if ((hints & HINT_WIPEONFORK) &&
+	    madvise(addr, length, MADV_WIPEONFORK))
+		failed |= HINT_WIPEONFORK;
+	if ((hints & HINT_DONTDUMP) && madvise(addr, length, MADV_DONTDUMP)) {
+		WARNING("MADV_DONTDUMP failed for %p: %s\n", addr,
+			strerror(errno));
+		failed |= HINT_DONTDUMP;
+	}
+	return failed;
+}
+
 #define IOV_LEN 64
 int hugetlbfs_prefault(void *addr, size_t length)
 {
@@ -1066,7 +1927,21 @@ int hugetlbfs_prefault(void *addr, size_t length)
 	 * prefaulting is enabled and we can't get all that were requested,
 	 * -ENOMEM is returned. The caller is expected to release the entire
 	 * mapping and optionally it may recover by mapping base pages instead.
+	 *
+	 * Where the kernel has MADV_POPULATE_WRITE the whole range is faulted
+	 * in with one call, and a shortage is reported rather than SIGBUS.
 	 */
+	if (hugetlbfs_test_feature(HUGETLB_FEATURE_MADV_POPULATE_WRITE) > 0) {
+		if (!madvise(addr, length, MADV_POPULATE_WRITE))
+			return 0;
+		if (errno != EINVAL) {
+			DEBUG("MADV_POPULATE_WRITE failed; err=%d\n", errno);
+			WARNING("Failed to reserve %ld huge pages "
+					"for new region\n",
+					length / gethugepagesize());
+			return -ENOMEM;
+		}
+	}
 
 	fd = open("/dev/zero", O_RDONLY);
 	if (fd < 0) {
@@ -19,10 +19,15 @@
 
 #include "libhugetlbfs_internal.h"
 
-static void __attribute__ ((constructor)) setup_libhugetlbfs(void)
+#include <sched.h>
+
+/*
+ * Mount scanning, page size probing and kernel feature detection are
+ * only needed once something asks for huge pages, so they are done on
+ * first use rather than in every process that loads the library.
+ */
+static void setup_libhugetlbfs_lazy(void)
 {
-	hugetlbfs_setup_env();
-	hugetlbfs_setup_debug();
 	hugetlbfs_setup_kernel_page_size();
 	setup_mounts();
 	probe_default_hpage_size();
@@ -32,6 +37,46 @@ static void __attribute__ ((constructor)) setup_libhugetlbfs(void)
 	hugetlbfs_check_priv_resv();
 	hugetlbfs_check_safe_noreserve();
 	hugetlbfs_check_map_hugetlb();
+}
+
+#define LAZY_INIT_NONE		0
+#define LAZY_INIT_RUNNING	1
+#define LAZY_INIT_DONE		2
+static int lazy_init_state = LAZY_INIT_NONE;
+/* The initialising thread may call back in, e.g. via test_feature() */
+static __thread int lazy_init_owner;
+
+void hugetlbfs_lazy_init(void)
+{
+	int state = LAZY_INIT_NONE;
+
+	if (__atomic_load_n(&lazy_init_state, __ATOMIC_ACQUIRE) ==
+							LAZY_INIT_DONE)
+		return;
+	if (lazy_init_owner)
+		return;
+
+	if (__atomic_compare_exchange_n(&lazy_init_state, &state,
+					LAZY_INIT_RUNNING, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		lazy_init_owner = 1;
+		setup_libhugetlbfs_lazy();
+		lazy_init_owner = 0;
+		__atomic_store_n(&lazy_init_state, LAZY_INIT_DONE,
+				 __ATOMIC_RELEASE);
+		return;
+	}
+
+	/* Another thread got there first, wait for it to finish */
+	while (__atomic_load_n(&lazy_init_state, __ATOMIC_ACQUIRE) !=
+							LAZY_INIT_DONE)
+		sched_yield();
+}
+
+static void __attribute__ ((constructor)) setup_libhugetlbfs(void)
+{
+	hugetlbfs_setup_env();
+	hugetlbfs_setup_debug();
 #ifndef NO_ELFLINK
 	hugetlbfs_setup_elflink();
 #endif
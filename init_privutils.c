@@ -19,6 +19,11 @@
 
 #include "libhugetlbfs_internal.h"
 
+/* The utilities set everything up eagerly in the constructor below */
+void hugetlbfs_lazy_init(void)
+{
+}
+
 static void __attribute__ ((constructor)) setup_libhugetlbfs(void)
 {
 	hugetlbfs_setup_debug();
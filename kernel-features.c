@@ -24,31 +24,272 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
 #include "kernel-features.h"
 #include "hugetlbfs.h"
 #include "libhugetlbfs_privutils.h"
 #include "libhugetlbfs_internal.h"
 #include "libhugetlbfs_debug.h"
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE		25
+#endif
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB		0x0004U
+#endif
+#ifndef SHM_HUGE_SHIFT
+#define SHM_HUGE_SHIFT		26
+#endif
+#ifndef SHM_NORESERVE
+#define SHM_NORESERVE		010000
+#endif
+
+/*
+ * Bump the version whenever a probe's result can change, so that a cache
+ * written by an older probe during this boot is not trusted.
+ * 2: MADV_COLLAPSE is probed on memory that has been touched.
+ * 3: shm_huge_size is not ruled out by a size above kernel.shmmax.
+ */
+#define FEATURE_CACHE		HUGETLB_RUN_DIR "/features"
+#define FEATURE_CACHE_MAGIC	"libhugetlbfs-features 3"
+
 static struct kernel_version running_kernel_version;
 
 /* This mask should always be 32 bits, regardless of the platform word size */
 static unsigned int feature_mask;
 
+/*
+ * Capability probes.  Distribution kernels backport features freely, so
+ * where the kernel can simply be asked, it is.  The probes are cheap but
+ * their results are still cached per boot under HUGETLB_RUN_DIR.
+ */
+
+/*
+ * There is no direct test for the two oldest features, but a kernel with
+ * memfd_create() (3.17) is well past both of them.
+ */
+static int probe_memfd_create(void)
+{
+#ifdef SYS_memfd_create
+	int fd = syscall(SYS_memfd_create, "libhugetlbfs", MFD_CLOEXEC);
+
+	if (fd >= 0) {
+		close(fd);
+		return 1;
+	}
+#endif
+	return -1;
+}
+
+static int probe_map_hugetlb(void)
+{
+	long hpage_size = kernel_default_hugepage_size();
+	long page_size = getpagesize();
+	void *p;
+	int ret;
+
+	if (hpage_size <= 0)
+		return -1;
+
+	p = mmap(NULL, hpage_size, PROT_READ,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return errno == EINVAL ? 0 : -1;
+
+	/*
+	 * Kernels without MAP_HUGETLB ignore the flag and hand out small
+	 * pages, which unlike a hugetlb mapping can be split anywhere.
+	 */
+	ret = munmap((char *)p + page_size, page_size) ? 1 : 0;
+	munmap(p, hpage_size);
+	return ret;
+}
+
+static int probe_madvise(int advice, size_t len)
+{
+	long page_size = getpagesize();
+	void *p;
+	int ret;
+
+	p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	/* Unknown advice is EINVAL, anything else means it was understood */
+	ret = madvise(p, page_size, advice);
+	ret = (ret && errno == EINVAL) ? 0 : 1;
+	munmap(p, len);
+	return ret;
+}
+
+static int probe_madv_populate_write(void)
+{
+	return probe_madvise(MADV_POPULATE_WRITE, getpagesize());
+}
+
+static int probe_madv_collapse(void)
+{
+	long hpage_size = kernel_default_hugepage_size();
+	char *p, *aligned;
+	int ret;
+
+	if (hpage_size <= 0)
+		return -1;
+
+	/*
+	 * The advice is refused as invalid for memory that has never been
+	 * touched, so fault in part of an aligned huge page and collapse it.
+	 */
+	p = mmap(NULL, 2 * hpage_size, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	aligned = (char *)ALIGN((unsigned long)p, hpage_size);
+	aligned[0] = 1;
+
+	ret = madvise(aligned, hpage_size, MADV_COLLAPSE);
+	ret = (ret && errno == EINVAL) ? 0 : 1;
+	munmap(p, 2 * hpage_size);
+	return ret;
+}
+
+static int probe_mfd_hugetlb(void)
+{
+#ifdef SYS_memfd_create
+	int fd = syscall(SYS_memfd_create, "libhugetlbfs",
+			 MFD_CLOEXEC|MFD_HUGETLB);
+
+	if (fd >= 0) {
+		close(fd);
+		return 1;
+	}
+	return (errno == EINVAL || errno == ENOSYS) ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+static int probe_cgroup_rsvd(void)
+{
+	char path[PATH_MAX+1], name[32];
+	long hpage_size = kernel_default_hugepage_size();
+
+	if (hpage_size <= 0)
+		return -1;
+	hugetlb_cgroup_size_name(name, sizeof(name), hpage_size);
+
+	/* cgroup v2 shows the rsvd files on the root, v1 on the hierarchy */
+	snprintf(path, sizeof(path), "/sys/fs/cgroup/hugetlb.%s.rsvd.current",
+		 name);
+	if (!access(path, F_OK))
+		return 1;
+	snprintf(path, sizeof(path),
+		 "/sys/fs/cgroup/hugetlb/hugetlb.%s.rsvd.limit_in_bytes", name);
+	if (!access(path, F_OK))
+		return 1;
+
+	/* No hugetlb controller mounted to ask */
+	return -1;
+}
+
+static int shm_probe(long size, int size_bits)
+{
+#ifdef SYS_shmget
+	struct shminfo info;
+	/* Bypass our own shmget() override */
+	int id = syscall(SYS_shmget, IPC_PRIVATE, size, IPC_CREAT | 0600 |
+			 SHM_HUGETLB | SHM_NORESERVE |
+			 (size_bits << SHM_HUGE_SHIFT));
+
+	if (id >= 0) {
+		shmctl(id, IPC_RMID, NULL);
+		return 1;
+	}
+	if (errno != EINVAL)
+		return -1;
+
+	/*
+	 * A size above kernel.shmmax is EINVAL too.  That is a sysctl,
+	 * not something the kernel lacks, so the answer is unknown.
+	 */
+	if (shmctl(0, IPC_INFO, (struct shmid_ds *)&info) < 0 ||
+	    (unsigned long)size > info.shmmax)
+		return -1;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static int probe_shm_huge_size(void)
+{
+	long hpage_size = kernel_default_hugepage_size();
+
+	if (hpage_size <= 0)
+		return -1;
+
+	/*
+	 * 2 byte pages are never valid, so a kernel that accepts them is
+	 * ignoring the size bits altogether.
+	 */
+	if (shm_probe(hpage_size, 1) != 0)
+		return -1;
+	return shm_probe(hpage_size, __builtin_ctzl(hpage_size));
+}
+
 static struct feature kernel_features[] = {
 	[HUGETLB_FEATURE_PRIVATE_RESV] = {
 		.name			= "private_reservations",
 		.required_version	= "2.6.27-rc1",
+		.probe			= probe_memfd_create,
 	},
 	[HUGETLB_FEATURE_SAFE_NORESERVE] = {
 		.name			= "noreserve_safe",
 		.required_version	= "2.6.34",
+		.probe			= probe_memfd_create,
 	},
 	[HUGETLB_FEATURE_MAP_HUGETLB] = {
 		.name			= "map_hugetlb",
 		.required_version	= "2.6.32",
-	}
+		.probe			= probe_map_hugetlb,
+	},
+	[HUGETLB_FEATURE_MADV_POPULATE_WRITE] = {
+		.name			= "madv_populate_write",
+		.required_version	= "5.14",
+		.probe			= probe_madv_populate_write,
+	},
+	[HUGETLB_FEATURE_MADV_COLLAPSE] = {
+		.name			= "madv_collapse",
+		.required_version	= "6.1",
+		.probe			= probe_madv_collapse,
+	},
+	[HUGETLB_FEATURE_MFD_HUGETLB] = {
+		.name			= "mfd_hugetlb",
+		.required_version	= "4.14",
+		.probe			= probe_mfd_hugetlb,
+	},
+	[HUGETLB_FEATURE_CGROUP_RSVD] = {
+		.name			= "cgroup_rsvd",
+		.required_version	= "5.7",
+		.probe			= probe_cgroup_rsvd,
+	},
+	[HUGETLB_FEATURE_SHM_HUGE_SIZE] = {
+		.name			= "shm_huge_size",
+		.required_version	= "3.8",
+		.probe			= probe_shm_huge_size,
+	},
 };
 
 static void debug_kernel_version(void)
@@ -206,6 +447,7 @@ int hugetlbfs_test_feature(int feature_code)
 		ERROR("hugetlbfs_test_feature: invalid feature code\n");
 		return -EINVAL;
 	}
+	hugetlbfs_lazy_init();
 	return feature_mask & (1 << feature_code);
 }
 
@@ -251,9 +493,89 @@ static int check_features_env_valid(const char *env)
 	return 0;
 }
 
+/* Probe every feature, falling back on the kernel version if need be */
+static unsigned int probe_features(void)
+{
+	unsigned int mask = 0;
+	int i, ret;
+
+	for (i = 0; i < HUGETLB_FEATURE_NR; i++) {
+		struct kernel_version ver;
+
+		ret = kernel_features[i].probe();
+		if (ret < 0) {
+			str_to_ver(kernel_features[i].required_version, &ver);
+			ret = ver_cmp(&running_kernel_version, &ver) >= 0;
+			DEBUG("Feature %s could not be probed, kernel version "
+				"says %s\n", kernel_features[i].name,
+				ret ? "yes" : "no");
+		}
+		if (ret)
+			mask |= (1UL << i);
+	}
+	return mask;
+}
+
+/*
+ * The probed (not user overridden) features are cached for the rest of
+ * the boot.  A cache missing any feature this library knows about was
+ * written by an older version and is ignored.
+ */
+static int read_feature_cache(unsigned int *mask)
+{
+	char buf[1024];
+	char *line, *eol, *val;
+	unsigned int seen = 0;
+	int i;
+
+	line = read_run_cache(FEATURE_CACHE, FEATURE_CACHE_MAGIC, buf,
+			      sizeof(buf));
+	if (!line)
+		return -1;
+
+	*mask = 0;
+	for (; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+		*eol = '\0';
+		val = strchr(line, ' ');
+		if (!val)
+			return -1;
+		*val++ = '\0';
+
+		for (i = 0; i < HUGETLB_FEATURE_NR; i++) {
+			if (strcmp(line, kernel_features[i].name))
+				continue;
+			seen |= (1UL << i);
+			if (*val == '1')
+				*mask |= (1UL << i);
+		}
+	}
+
+	if (seen != (1UL << HUGETLB_FEATURE_NR) - 1)
+		return -1;
+	DEBUG("Using kernel features from %s\n", FEATURE_CACHE);
+	return 0;
+}
+
+static void write_feature_cache(unsigned int mask)
+{
+	char buf[1024];
+	size_t used = 0;
+	int i;
+
+	for (i = 0; i < HUGETLB_FEATURE_NR; i++)
+		used += snprintf(buf + used, sizeof(buf) - used, "%s %d\n",
+				 kernel_features[i].name,
+				 !!(mask & (1UL << i)));
+
+	if (write_run_cache(FEATURE_CACHE, FEATURE_CACHE_MAGIC, buf))
+		DEBUG("Unable to write %s: %s\n", FEATURE_CACHE,
+			strerror(errno));
+}
+
 void setup_features()
 {
 	struct utsname u;
+	unsigned int probed;
 	int i;
 
 	if (uname(&u)) {
@@ -271,13 +593,17 @@ void setup_features()
 		__hugetlb_opts.features = NULL;
 	}
 
+	if (__hugetlb_opts.no_feature_cache || read_feature_cache(&probed)) {
+		probed = probe_features();
+		/* Only root can write HUGETLB_RUN_DIR, and only root is trusted */
+		if (!__hugetlb_opts.no_feature_cache && geteuid() == 0)
+			write_feature_cache(probed);
+	}
+
 	for (i = 0; i < HUGETLB_FEATURE_NR; i++) {
-		struct kernel_version ver;
 		char *name = kernel_features[i].name;
 		char *pos;
 
-		str_to_ver(kernel_features[i].required_version, &ver);
-
 		/* Has the user overridden feature detection? */
 		if (__hugetlb_opts.features &&
 			(pos = strstr(__hugetlb_opts.features, name))) {
@@ -293,8 +619,7 @@ void setup_features()
 			continue;
 		}
 
-		/* Is the running kernel version newer? */
-		if (ver_cmp(&running_kernel_version, &ver) >= 0) {
+		if (probed & (1UL << i)) {
 			INFO("Feature %s is present in this kernel\n",
 				kernel_features[i].name);
 			feature_mask |= (1UL << i);
@@ -27,4 +27,6 @@ struct kernel_version {
 struct feature {
 	char *name;
 	char *required_version;
+	/* Returns 1 if present, 0 if absent, -1 to fall back on the version */
+	int (*probe)(void);
 };
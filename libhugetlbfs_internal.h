@@ -61,11 +61,22 @@ struct libhugeopts_t {
 	int		sharing;
 	bool		min_copy;
 	bool		shrink_ok;
+	bool		shrink_lazy;
 	bool		shm_enabled;
 	bool		no_reserve;
 	bool		map_hugetlb;
 	bool		thp_morecore;
+	bool		heap_noncontig;
+	bool		heap_thp_fallback;
+	bool		no_mount_cache;
+	bool		force_mount_cache;
+	bool		no_feature_cache;
 	unsigned long	force_elfmap;
+	unsigned long	deferred_free;
+	unsigned long	thp_collapse;
+	unsigned long	trim_delay;
+	unsigned int	heap_hints;
+	unsigned int	segment_hints;
 	char		*ld_preload;
 	char		*elfmap;
 	char		*share_path;
@@ -74,6 +85,9 @@ struct libhugeopts_t {
 	char		*def_page_size;
 	char		*morecore;
 	char		*heapbase;
+	char		*heap_growth;
+	char		*heap_reserve;
+	char		*trim_keep;
 };
 
 /*
@@ -93,12 +107,18 @@ extern bool __hugetlbfs_debug;
 extern bool __hugetlbfs_prefault;
 #define hugetlbfs_setup_env __lh_hugetlbfs_setup_env
 extern void hugetlbfs_setup_env();
+#define hugetlbfs_load_policy __lh_hugetlbfs_load_policy
+extern void hugetlbfs_load_policy(void);
+#define hugetlbfs_getenv __lh_hugetlbfs_getenv
+extern char *hugetlbfs_getenv(const char *name);
 #define hugetlbfs_setup_elflink __lh_hugetlbfs_setup_elflink
 extern void hugetlbfs_setup_elflink();
 #define hugetlbfs_setup_morecore __lh_hugetlbfs_setup_morecore
 extern void hugetlbfs_setup_morecore();
 #define hugetlbfs_setup_debug __lh_hugetlbfs_setup_debug
 extern void hugetlbfs_setup_debug();
+#define hugetlbfs_lazy_init __lh_hugetlbfs_lazy_init
+extern void hugetlbfs_lazy_init(void);
 #define setup_mounts __lh_setup_mounts
 extern void setup_mounts();
 #define setup_features __lh_setup_features
@@ -113,6 +133,17 @@ extern void hugetlbfs_check_map_hugetlb();
 extern char __hugetlbfs_hostname[];
 #define hugetlbfs_prefault __lh_hugetlbfs_prefault
 extern int hugetlbfs_prefault(void *addr, size_t length);
+/* What happens to a mapping on fork() and in a core dump */
+#define HINT_DONTFORK		0x1
+#define HINT_WIPEONFORK		0x2
+#define HINT_DONTDUMP		0x4
+#define hugetlbfs_madvise_hints __lh_hugetlbfs_madvise_hints
+extern unsigned int hugetlbfs_madvise_hints(void *addr, size_t length,
+					    unsigned int hints);
+/* Copies at least this large use hugetlbfs_stream_copy() */
+#define STREAM_COPY_MIN		(4UL << 20)
+#define cachecolor __lh_cachecolor
+extern void *cachecolor(void *buf, size_t len, size_t color_bytes);
 #define parse_page_size __lh_parse_page_size
 extern long parse_page_size(const char *str);
 #define probe_default_hpage_size __lh__probe_default_hpage_size
@@ -190,6 +221,32 @@ extern int hpool_sizes(struct hpage_pool *, int);
 #define get_pool_size __lh_get_pool_size
 extern int get_pool_size(long, struct hpage_pool *);
 
+#define cgroup2_mount __lh_cgroup2_mount
+extern const char *cgroup2_mount(void);
+#define hugetlb_cgroup_size_name __lh_hugetlb_cgroup_size_name
+extern void hugetlb_cgroup_size_name(char *buf, size_t len, long page_size);
+#define hugetlb_cgroup_read __lh_hugetlb_cgroup_read
+extern long hugetlb_cgroup_read(const char *dir, long page_size,
+				const char *file);
+#define hugetlb_cgroup_budget __lh_hugetlb_cgroup_budget
+extern long hugetlb_cgroup_budget(long page_size);
+
+#define HUGETLB_RUN_DIR "/run/libhugetlbfs"
+#define MOUNT_CACHE_MAGIC "libhugetlbfs-mounts 2"
+
+#define read_boot_id __lh_read_boot_id
+extern int read_boot_id(char *buf, size_t len);
+#define open_trusted_file __lh_open_trusted_file
+extern int open_trusted_file(const char *path);
+#define read_run_cache __lh_read_run_cache
+extern char *read_run_cache(const char *path, const char *magic, char *buf,
+			    size_t len);
+#define write_run_cache __lh_write_run_cache
+extern int write_run_cache(const char *path, const char *magic,
+			   const char *body);
+#define write_mount_cache __lh_write_mount_cache
+extern int write_mount_cache(void);
+
 /* Arch-specific callbacks */
 extern int direct_syscall(int sysnum, ...);
 extern ElfW(Word) plt_extrasz(ElfW(Dyn) *dyntab);
@@ -83,6 +83,21 @@ enum {
 	/* If the kernel has the ability to mmap(MAP_HUGETLB)*/
 	HUGETLB_FEATURE_MAP_HUGETLB,
 
+	/* madvise(MADV_POPULATE_WRITE) can prefault a range */
+	HUGETLB_FEATURE_MADV_POPULATE_WRITE,
+
+	/* madvise(MADV_COLLAPSE) can synchronously collapse THPs */
+	HUGETLB_FEATURE_MADV_COLLAPSE,
+
+	/* memfd_create(MFD_HUGETLB) is available */
+	HUGETLB_FEATURE_MFD_HUGETLB,
+
+	/* The hugetlb cgroup controller accounts reservations */
+	HUGETLB_FEATURE_CGROUP_RSVD,
+
+	/* shmget() accepts a page size in the SHM_HUGE_SHIFT bits */
+	HUGETLB_FEATURE_SHM_HUGE_SIZE,
+
 	HUGETLB_FEATURE_NR,
 };
 #define hugetlbfs_test_feature __pu_hugetlbfs_test_feature
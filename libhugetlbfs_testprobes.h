@@ -36,4 +36,7 @@
 		__tp_kernel_default_hugepage_size_reset
 void kernel_default_hugepage_size_reset(void);
 
+#define hugetlbfs_stream_copy __tp_hugetlbfs_stream_copy
+void hugetlbfs_stream_copy(void *dst, const void *src, size_t len);
+
 #endif /* _LIBHUGETLBFS_TESTPROBES_H */
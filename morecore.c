@@ -28,6 +28,9 @@
 #include <dlfcn.h>
 #include <string.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "hugetlbfs.h"
 
@@ -40,6 +43,72 @@ static void *heaptop;
 static long mapsize;
 static long hpage_size;
 
+/*
+ * Growth policy.  With HUGETLB_MORECORE_GROWTH the heap grows by at
+ * least its own size each time, up to that step, so a heap growing
+ * steadily calls mmap() a few times rather than once per huge page.
+ * With HUGETLB_MORECORE_RESERVE, address space for the heap is held up
+ * front by an inaccessible mapping that growth maps over, so nothing
+ * else can be placed in the way.  Only what malloc is about to use is
+ * prefaulted; the rest of a large step is faulted as the heap reaches
+ * it.
+ */
+static long growth_step;
+static long reserve_size;
+static void *reserve_end;
+static void *prefault_end;
+
+/*
+ * With HUGETLB_MORECORE_NONCONTIG, a heap that cannot grow in place
+ * because something else is mapped there continues in the lowest free
+ * range above it.  glibc takes the jump in the break like memory
+ * sbrk()ed by someone else: it fences off the end of the old segment,
+ * which stays in use, and carries on from the new one.  The jump must
+ * be upwards, as glibc aborts if the break moves below memory it has
+ * been given.  heap_offset is where the current segment starts in the
+ * heap file, so that the segments do not share pages.
+ */
+static long heap_offset;
+static int heap_segments = 1;
+
+/*
+ * With HUGETLB_MORECORE_FALLBACK=thp, a heap that runs out of huge pages
+ * carries on at the same addresses with anonymous memory advised
+ * MADV_HUGEPAGE, so malloc() still sees one contiguous heap.  thp_start
+ * is where that tier begins in the current segment.  The heap stays on
+ * THP until it shrinks back below thp_start; the pool is not tried again
+ * above it.  left_hugetlb and left_thp count what earlier segments hold.
+ */
+static void *thp_start;
+static long left_hugetlb;
+static long left_thp;
+
+/*
+ * With HUGETLB_MORECORE_SHRINK=lazy, shrinking the heap only moves the
+ * break.  A thread trims the heap later, leaving mapped the peak it
+ * reached in the last trim_delay seconds plus trim_keep bytes.  Bursty
+ * programs then regrow into pages that are still mapped, and free() and
+ * malloc() never unmap or map.  trim_lock serialises the thread with
+ * morecore, which runs under malloc's locks.
+ *
+ * glibc assumes memory it gets from morecore is zeroed.  Memory above
+ * the break that was handed out before, up to dirty_end, is cleared by
+ * the thread, or on regrowth if the thread has not reached it yet.
+ */
+static int trimming;
+static long trim_keep;
+static void *peak_top;
+static void *dirty_end;
+static pthread_mutex_t trim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define TRIM_CLEAR_CHUNK	(2UL << 20)
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE	0x100000
+#endif
+
+#define RESERVE_FLAGS	(MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE)
+
 static long hugetlbfs_next_addr(long addr)
 {
 #if defined(__powerpc64__)
@@ -56,6 +125,250 @@ static long hugetlbfs_next_addr(long addr)
 #endif
 }
 
+/* Reserve len bytes of address space at addr, which must be free */
+static int reserve_at(void *addr, long len)
+{
+	void *p;
+
+	p = mmap(addr, len, PROT_NONE, RESERVE_FLAGS|MAP_FIXED_NOREPLACE,
+		 -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	if (p != addr) {
+		/* Kernels before 4.17 treat the address as a hint */
+		munmap(p, len);
+		return -1;
+	}
+	return 0;
+}
+
+/* Is [addr, addr + len) reserved for the heap?  Extends the reservation */
+static int heap_reserved(void *addr, long len)
+{
+	if (!reserve_end || addr > reserve_end)
+		return 0;
+	if (addr + len <= reserve_end)
+		return 1;
+	if (reserve_at(reserve_end, addr + len - reserve_end) < 0)
+		return 0;
+	reserve_end = addr + len;
+	return 1;
+}
+
+/* Release heap memory, keeping its address space if it was reserved */
+static int heap_unmap(void *addr, long len)
+{
+	if (heap_reserved(addr, len))
+		return mmap(addr, len, PROT_NONE, RESERVE_FLAGS|MAP_FIXED,
+			    -1, 0) == MAP_FAILED ? -1 : 0;
+	return munmap(addr, len);
+}
+
+/* Map len bytes of the heap at addr, continuing the file at the heap top */
+static void *heap_mmap(void *addr, long len, int flags)
+{
+	int mmap_reserve = __hugetlb_opts.no_reserve ? MAP_NORESERVE : 0;
+	int mmap_hugetlb = 0;
+
+#ifdef MAP_HUGETLB
+	mmap_hugetlb = MAP_HUGETLB;
+#endif
+
+	/* Without a file the heap is MAP_HUGETLB */
+	if (heap_fd < 0)
+		return mmap(addr, len, PROT_READ|PROT_WRITE,
+			    mmap_hugetlb|MAP_ANONYMOUS|MAP_PRIVATE|mmap_reserve|
+			    flags, -1, 0);
+	return mmap(addr, len, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|mmap_reserve|flags, heap_fd,
+		    heap_offset + mapsize);
+}
+
+/* Map len bytes of THP-advised anonymous memory for the heap at addr */
+static void *heap_mmap_thp(void *addr, long len, int flags)
+{
+	void *p;
+
+	p = mmap(addr, len, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|flags, -1, 0);
+#ifdef MADV_HUGEPAGE
+	if (p != MAP_FAILED)
+		madvise(p, len, MADV_HUGEPAGE);
+#endif
+	return p;
+}
+
+/* Bytes of the current segment on huge pages and on THP */
+static long segment_hugetlb(void)
+{
+	return thp_start ? thp_start - heapbase : mapsize;
+}
+
+static void report_heap_tiers(void)
+{
+	long hugetlb = left_hugetlb + segment_hugetlb();
+	long thp = left_thp + mapsize - segment_hugetlb();
+
+	INFO("Heap has %ld kB on huge pages, %ld kB on THP\n",
+	     hugetlb / 1024, thp / 1024);
+}
+
+/*
+ * Find the lowest huge page aligned range of len free bytes above addr.
+ * This runs with malloc's locks held, so /proc/self/maps is read with
+ * plain syscalls into a static buffer.
+ */
+static void *find_gap_above(void *addr, long len)
+{
+	static char buf[8192];
+	unsigned long start, end, gap;
+	size_t fill = 0;
+	ssize_t bytes;
+	char *line, *eol;
+	int fd;
+
+	gap = hugetlbfs_next_addr((long)addr);
+	fd = open("/proc/self/maps", O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	while ((bytes = read(fd, buf + fill, sizeof(buf) - 1 - fill)) > 0) {
+		fill += bytes;
+		buf[fill] = '\0';
+		for (line = buf; (eol = strchr(line, '\n')); line = eol + 1) {
+			if (sscanf(line, "%lx-%lx", &start, &end) != 2 ||
+			    end <= gap)
+				continue;
+			if (start >= gap + len)
+				goto out;
+			gap = hugetlbfs_next_addr(end);
+		}
+		fill -= line - buf;
+		memmove(buf, line, fill);
+	}
+out:
+	close(fd);
+	return (void *)gap;
+}
+
+/*
+ * Start a new heap segment of at least *delta bytes, given the mapping p
+ * the kernel placed away from the heap top, and make it the heap.
+ * Returns the new segment, or NULL if there is no room above the heap.
+ */
+static void *heap_hop(void *p, long *delta, ptrdiff_t increment, int thp)
+{
+	long len = ALIGN(increment, hpage_size);
+	void *gap;
+
+	if (len < *delta)
+		len = *delta;
+
+	/* A mapping above the heap top will do if it is large enough */
+	if (p < heaptop || len > *delta) {
+		munmap(p, *delta);
+		gap = find_gap_above(heaptop, len > reserve_size ? len :
+						     reserve_size);
+		if (!gap)
+			return NULL;
+
+		/* The new segment gets a reservation like the first */
+		reserve_end = NULL;
+		if (reserve_size >= len && reserve_at(gap, reserve_size) == 0)
+			reserve_end = gap + reserve_size;
+
+		p = (thp ? heap_mmap_thp : heap_mmap)(gap, len,
+				reserve_end ? MAP_FIXED : MAP_FIXED_NOREPLACE);
+		if (p == MAP_FAILED || p != gap) {
+			if (p != MAP_FAILED)
+				munmap(p, len);
+			if (reserve_end)
+				munmap(gap, reserve_size);
+			reserve_end = NULL;
+			return NULL;
+		}
+	} else {
+		reserve_end = NULL;
+	}
+
+	heap_segments++;
+	INFO("Heap continues at %p after %p, %d segments\n", p,
+	     heapbase + mapsize, heap_segments);
+	left_hugetlb += segment_hugetlb();
+	left_thp += mapsize - segment_hugetlb();
+	heap_offset += mapsize;
+	heapbase = heaptop = prefault_end = p;
+	thp_start = thp ? p : NULL;
+	mapsize = 0;
+	*delta = len;
+	return p;
+}
+
+/* How much to grow the heap by when it needs at least delta more */
+static long heap_growth(long delta)
+{
+	long step = mapsize;
+
+	if (!growth_step)
+		return delta;
+	if (step > growth_step)
+		step = growth_step;
+	return delta > step ? delta : ALIGN(step, hpage_size);
+}
+
+/* Fault in the heap up to top, the end of what malloc is being given */
+static int heap_prefault(void *top)
+{
+	/* The THP tier is ordinary anonymous memory */
+	if (thp_start && top > thp_start)
+		top = thp_start;
+	top = (void *)ALIGN((unsigned long)top, hpage_size);
+	if (top <= prefault_end)
+		return 0;
+	if (hugetlbfs_prefault(prefault_end, top - prefault_end) != 0)
+		return -1;
+	prefault_end = top;
+	return 0;
+}
+
+/* Unmap the top -delta bytes of the heap */
+static void heap_shrink(long delta)
+{
+	int ret;
+
+	INFO("Attempting to unmap %ld bytes @ %p\n", -delta,
+		heapbase + mapsize + delta);
+	ret = heap_unmap(heapbase + mapsize + delta, -delta);
+	if (ret) {
+		WARNING("Unmapping failed while shrinking heap: "
+			"%s\n", strerror(errno));
+		return;
+	}
+
+	mapsize += delta;
+	if (prefault_end > heapbase + mapsize)
+		prefault_end = heapbase + mapsize;
+	if (dirty_end > heapbase + mapsize)
+		dirty_end = heapbase + mapsize;
+	if (thp_start) {
+		if (thp_start >= heapbase + mapsize)
+			thp_start = NULL;
+		report_heap_tiers();
+	}
+
+	/*
+	 * Now shrink the hugetlbfs file, if the heap has one.
+	 */
+	if (heap_fd >= 0) {
+		ret = ftruncate(heap_fd, heap_offset + segment_hugetlb());
+		if (ret) {
+			WARNING("Could not truncate hugetlbfs "
+				"file to shrink heap: %s\n",
+				strerror(errno));
+		}
+	}
+}
+
 /*
  * Our plan is to ask for pages 'roughly' at the BASE.  We expect and
  * require the kernel to offer us sequential pages from wherever it
@@ -66,15 +379,12 @@ static long hugetlbfs_next_addr(long addr)
  * Luckily, if it does not do so and we error out malloc will happily
  * go back to small pages and use mmap to get them.  Hurrah.
  */
-static void *hugetlbfs_morecore(ptrdiff_t increment)
+static void *heap_morecore(ptrdiff_t increment)
 {
-	int ret;
 	void *p;
-	long delta;
-	int mmap_reserve = __hugetlb_opts.no_reserve ? MAP_NORESERVE : 0;
-	int mmap_hugetlb = 0;
-	int using_default_pagesize =
-		(hpage_size == kernel_default_hugepage_size());
+	long delta, need, budget;
+	int mmap_fixed = 0;
+	int thp = thp_start != NULL;
 
 	INFO("hugetlbfs_morecore(%ld) = ...\n", (long)increment);
 
@@ -90,23 +400,51 @@ static void *hugetlbfs_morecore(ptrdiff_t increment)
 	/* align to multiple of hugepagesize. */
 	delta = ALIGN(delta, hpage_size);
 
-#ifdef MAP_HUGETLB
-	mmap_hugetlb = MAP_HUGETLB;
-#endif
-
 	if (delta > 0) {
 		/* growing the heap */
+		need = delta;
+		delta = heap_growth(need);
+
+		budget = thp ? -1 : hugetlb_cgroup_budget(hpage_size);
+		if (budget >= 0 && budget < delta)
+			delta = need;
+		if (budget >= 0 && budget < delta) {
+			WARNING("hugetlb cgroup limit allows %ld more bytes, "
+				"heap needs %ld\n", budget, delta);
+			if (!__hugetlb_opts.heap_thp_fallback)
+				return NULL;
+			thp = 1;
+		}
+
+		/* Map over the reservation, if the heap has one */
+		if (heap_reserved(heapbase + mapsize, delta)) {
+			mmap_fixed = MAP_FIXED;
+		} else if (delta > need &&
+			   heap_reserved(heapbase + mapsize, need)) {
+			delta = need;
+			mmap_fixed = MAP_FIXED;
+		}
 
 		INFO("Attempting to map %ld bytes\n", delta);
 
 		/* map in (extend) more of the file at the end of our last map */
-		if (__hugetlb_opts.map_hugetlb && using_default_pagesize)
-			p = mmap(heapbase + mapsize, delta, PROT_READ|PROT_WRITE,
-				 mmap_hugetlb|MAP_ANONYMOUS|MAP_PRIVATE|mmap_reserve,
-				 heap_fd, mapsize);
-		else
-			p = mmap(heapbase + mapsize, delta, PROT_READ|PROT_WRITE,
-				 MAP_PRIVATE|mmap_reserve, heap_fd, mapsize);
+		p = MAP_FAILED;
+		if (!thp) {
+			p = heap_mmap(heapbase + mapsize, delta, mmap_fixed);
+			if (p == MAP_FAILED && delta > need) {
+				/* The pool may still cover what is needed */
+				delta = need;
+				p = heap_mmap(heapbase + mapsize, delta,
+					      mmap_fixed);
+			}
+		}
+		if (p == MAP_FAILED && __hugetlb_opts.heap_thp_fallback) {
+			if (!thp)
+				INFO("Out of huge pages, heap continues on "
+				     "THP at %p\n", heapbase + mapsize);
+			thp = 1;
+			p = heap_mmap_thp(heapbase + mapsize, delta, mmap_fixed);
+		}
 
 		if (p == MAP_FAILED) {
 			WARNING("New heap segment map at %p failed: %s\n",
@@ -123,27 +461,50 @@ static void *hugetlbfs_morecore(ptrdiff_t increment)
 					dump_proc_pid_maps();
 			}
 			/* then setup the heap variables */
-			heapbase = heaptop = p;
+			heapbase = heaptop = prefault_end = p;
 		} else if (p != (heapbase + mapsize)) {
 			/* Couldn't get the mapping where we wanted */
-			munmap(p, delta);
-			WARNING("New heap segment mapped at %p instead of %p\n",
-			      p, heapbase + mapsize);
-			if (__hugetlbfs_debug)
-				dump_proc_pid_maps();
-			return NULL;
+			if (!__hugetlb_opts.heap_noncontig) {
+				munmap(p, delta);
+				WARNING("New heap segment mapped at %p instead "
+					"of %p\n", p, heapbase + mapsize);
+				if (__hugetlbfs_debug)
+					dump_proc_pid_maps();
+				return NULL;
+			}
+			p = heap_hop(p, &delta, increment, thp);
+			if (!p) {
+				WARNING("No room for the heap above %p\n",
+					heaptop);
+				return NULL;
+			}
 		}
+		if (thp && !thp_start)
+			thp_start = p;
 
 		/* Fault the region to ensure accesses succeed */
-		if (hugetlbfs_prefault(p, delta) != 0) {
-			munmap(p, delta);
+		if (heap_prefault(heaptop + increment) != 0) {
+			heap_unmap(p, delta);
+			if (thp_start == p)
+				thp_start = NULL;
 			return NULL;
 		}
+		hugetlbfs_madvise_hints(p, delta, __hugetlb_opts.heap_hints);
 
 		/* we now have mmap'd further */
 		mapsize += delta;
-	} else if (delta < 0) {
-		/* shrinking the heap */
+		if (thp)
+			report_heap_tiers();
+	} else if (increment > 0) {
+		/* growing into space mapped by an earlier, larger step */
+		if (heap_prefault(heaptop + increment) != 0)
+			return NULL;
+	} else if (increment < 0 && delta < 0) {
+		/*
+		 * shrinking the heap.  With geometric growth delta is
+		 * negative for MORECORE(0) too, which glibc uses to find the
+		 * break: that must not shrink or fail.
+		 */
 
 		if (!__hugetlb_opts.shrink_ok) {
 			/* shouldn't ever get here */
@@ -172,25 +533,9 @@ static void *hugetlbfs_morecore(ptrdiff_t increment)
 			/* we need heaptop + increment == heapbase, so: */
 			increment = heapbase - heaptop;
 		}
-		INFO("Attempting to unmap %ld bytes @ %p\n", -delta,
-			heapbase + mapsize + delta);
-		ret = munmap(heapbase + mapsize + delta, -delta);
-		if (ret) {
-			WARNING("Unmapping failed while shrinking heap: "
-				"%s\n", strerror(errno));
-		} else if (!__hugetlb_opts.map_hugetlb && !using_default_pagesize){
-
-			/*
-			 * Now shrink the hugetlbfs file.
-			 */
-			mapsize += delta;
-			ret = ftruncate(heap_fd, mapsize);
-			if (ret) {
-				WARNING("Could not truncate hugetlbfs file to "
-					"shrink heap: %s\n", strerror(errno));
-			}
-		}
-
+		/* With lazy shrinking the trim thread unmaps it later */
+		if (!trimming)
+			heap_shrink(delta);
 	}
 
 	/* heap is continuous */
@@ -202,6 +547,41 @@ static void *hugetlbfs_morecore(ptrdiff_t increment)
 	return p;
 }
 
+/* Zero memory above the break that malloc() had before, up to end */
+static void heap_clear(void *end)
+{
+	if (end > dirty_end)
+		end = dirty_end;
+	if (end <= heaptop)
+		return;
+	memset(heaptop, 0, end - heaptop);
+	if (end == dirty_end)
+		dirty_end = NULL;
+}
+
+static void *hugetlbfs_morecore(ptrdiff_t increment)
+{
+	void *oldtop, *p;
+
+	if (trimming)
+		pthread_mutex_lock(&trim_lock);
+
+	oldtop = heaptop;
+	if (increment > 0)
+		heap_clear(heaptop + increment);
+	p = heap_morecore(increment);
+	if (p && increment < 0 && dirty_end < oldtop)
+		dirty_end = oldtop;
+	if (dirty_end > heapbase + mapsize)
+		dirty_end = heapbase + mapsize;
+	if (heaptop > peak_top)
+		peak_top = heaptop;
+
+	if (trimming)
+		pthread_mutex_unlock(&trim_lock);
+	return p;
+}
+
 static void *thp_morecore(ptrdiff_t increment)
 {
 	void *p;
@@ -241,10 +621,12 @@ static void *thp_morecore(ptrdiff_t increment)
 			heapbase = heaptop = p;
 		}
 
-		mapsize += delta;
+		/* Published for the collapse thread */
+		__atomic_store_n(&mapsize, mapsize + delta, __ATOMIC_RELEASE);
 #ifdef MADV_HUGEPAGE
 		madvise(p, delta, MADV_HUGEPAGE);
 #endif
+		hugetlbfs_madvise_hints(p, delta, __hugetlb_opts.heap_hints);
 	} else if (delta < 0) {
 		/* shrinking the heap */
 		if (!mapsize) {
@@ -260,7 +642,7 @@ static void *thp_morecore(ptrdiff_t increment)
 			return heaptop;
 		}
 
-		mapsize += delta;
+		__atomic_store_n(&mapsize, mapsize + delta, __ATOMIC_RELEASE);
 	}
 
 	p = heaptop;
@@ -269,6 +651,270 @@ static void *thp_morecore(ptrdiff_t increment)
 	return p;
 }
 
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE		25
+#endif
+
+/*
+ * With HUGETLB_MORECORE_COLLAPSE, a thread collapses the THP heap into
+ * huge pages with MADV_COLLAPSE rather than leaving it to khugepaged,
+ * which scans the whole system slowly.  The heap below the cursor has
+ * been collapsed; each pass works upwards from it through the ranges
+ * malloc has touched, at most the configured MB each second.  Every
+ * COLLAPSE_RESCAN passes it starts again from the bottom, in case pages
+ * were split since; collapsing a range that is still huge is cheap.
+ */
+#define COLLAPSE_INTERVAL	1	/* seconds */
+#define COLLAPSE_RESCAN		60	/* passes */
+#define PAGEMAP_PRESENT		(1ULL << 63)
+#define PAGEMAP_SWAPPED		(1ULL << 62)
+
+/* Has anything in the range been faulted in? */
+static int range_touched(int pagemap_fd, unsigned long start, long len)
+{
+	uint64_t entries[512];
+	long page_size = getpagesize();
+	unsigned long addr;
+	ssize_t bytes;
+	long i, n;
+
+	for (addr = start; addr < start + len; addr += n * page_size) {
+		n = (start + len - addr) / page_size;
+		if (n > 512)
+			n = 512;
+		bytes = pread(pagemap_fd, entries, n * sizeof(entries[0]),
+			      addr / page_size * sizeof(entries[0]));
+		if (bytes <= 0)
+			return 0;
+		n = bytes / sizeof(entries[0]);
+		for (i = 0; i < n; i++)
+			if (entries[i] & (PAGEMAP_PRESENT|PAGEMAP_SWAPPED))
+				return 1;
+	}
+	return 0;
+}
+
+/* Costs a walk of every mapping, so only done when it will be seen */
+static void report_heap_coverage(unsigned long start, unsigned long end)
+{
+	unsigned long vstart, vend, kb, huge = 0;
+	int in_heap = 0;
+	char line[256];
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &vstart, &vend) == 2)
+			in_heap = vstart < end && vend > start;
+		else if (in_heap &&
+			 sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+			huge += kb << 10;
+	}
+	fclose(f);
+
+	INFO("THP heap: %lu of %lu MB on huge pages\n", huge >> 20,
+	     (end - start) >> 20);
+}
+
+static void *heap_collapser(void *arg)
+{
+	unsigned long budget = __hugetlb_opts.thp_collapse << 20;
+	unsigned long start, end, done, cursor = 0;
+	long size;
+	int fd, passes = 0;
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	fd = open("/proc/self/pagemap", O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		WARNING("THP collapse thread can't open pagemap: %s\n",
+			strerror(errno));
+		return NULL;
+	}
+
+	for (;; sleep(COLLAPSE_INTERVAL)) {
+		size = __atomic_load_n(&mapsize, __ATOMIC_ACQUIRE);
+		if (size <= 0)
+			continue;
+		start = ALIGN((unsigned long)heapbase, hpage_size);
+		end = ALIGN_DOWN((unsigned long)heapbase + size, hpage_size);
+		if (cursor < start || cursor > end ||
+		    ++passes % COLLAPSE_RESCAN == 0)
+			cursor = start;
+
+		/* Untouched ranges can still fault in huge pages */
+		for (done = 0; cursor < end && done < budget;
+		     cursor += hpage_size) {
+			if (!range_touched(fd, cursor, hpage_size))
+				continue;
+			if (madvise((void *)cursor, hpage_size, MADV_COLLAPSE)) {
+				DEBUG("MADV_COLLAPSE at 0x%lx failed: %s\n",
+				      cursor, strerror(errno));
+				continue;
+			}
+			done += hpage_size;
+		}
+
+		if (done && __hugetlbfs_verbose >= VERBOSE_INFO)
+			report_heap_coverage(start, end);
+	}
+	return NULL;
+}
+
+static void start_heap_collapser(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (hugetlbfs_test_feature(HUGETLB_FEATURE_MADV_COLLAPSE) <= 0) {
+		WARNING("HUGETLB_MORECORE_COLLAPSE needs MADV_COLLAPSE, "
+			"leaving the heap to khugepaged\n");
+		return;
+	}
+
+	/* The thread does not survive fork(), children rely on khugepaged */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, heap_collapser, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret)
+		WARNING("Unable to start THP collapse thread: %s\n",
+			strerror(ret));
+	else
+		INFO("Collapsing the THP heap at up to %lu MB/s\n",
+		     __hugetlb_opts.thp_collapse);
+}
+
+/* Trim what the heap has not needed since the last pass */
+static void trim_heap(void)
+{
+	void *keep = (void *)ALIGN((unsigned long)peak_top, hpage_size) +
+		trim_keep;
+
+	if (keep < heaptop)
+		keep = (void *)ALIGN((unsigned long)heaptop, hpage_size);
+	if (keep < heapbase + mapsize)
+		heap_shrink(keep - (heapbase + mapsize));
+	peak_top = heaptop;
+}
+
+/*
+ * The thread takes trim_fork_lock around its work as well as trim_lock,
+ * and fork() takes trim_fork_lock, so the child never sees the heap half
+ * trimmed or half cleared.  trim_lock itself cannot be held over fork():
+ * glibc takes malloc's locks after the prepare handlers, and a thread in
+ * morecore holding one of those may be waiting for trim_lock.
+ */
+static pthread_mutex_t trim_fork_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void trim_lock_thread(void)
+{
+	pthread_mutex_lock(&trim_fork_lock);
+	pthread_mutex_lock(&trim_lock);
+}
+
+static void trim_unlock_thread(void)
+{
+	pthread_mutex_unlock(&trim_lock);
+	pthread_mutex_unlock(&trim_fork_lock);
+}
+
+static void *heap_trimmer(void *arg)
+{
+	unsigned long delay = __hugetlb_opts.trim_delay;
+	unsigned long passes = 0;
+	void *start;
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (!delay)
+		delay = 1;
+
+	for (;; sleep(1)) {
+		trim_lock_thread();
+		if (++passes % delay == 0)
+			trim_heap();
+		trim_unlock_thread();
+
+		/* Clear the cache a chunk at a time, so malloc() can get in */
+		for (;;) {
+			trim_lock_thread();
+			if (dirty_end <= heaptop) {
+				trim_unlock_thread();
+				break;
+			}
+			start = dirty_end - TRIM_CLEAR_CHUNK;
+			if (start < heaptop || start > dirty_end)
+				start = heaptop;
+			memset(start, 0, dirty_end - start);
+			dirty_end = start > heaptop ? start : NULL;
+			trim_unlock_thread();
+		}
+	}
+	return NULL;
+}
+
+static void heap_trimmer_prepare(void)
+{
+	pthread_mutex_lock(&trim_fork_lock);
+}
+
+static void heap_trimmer_parent(void)
+{
+	pthread_mutex_unlock(&trim_fork_lock);
+}
+
+/* The thread is not copied by fork(), so the child shrinks directly */
+static void heap_trimmer_child(void)
+{
+	pthread_mutex_init(&trim_fork_lock, NULL);
+	pthread_mutex_init(&trim_lock, NULL);
+	trimming = 0;
+}
+
+static void start_heap_trimmer(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	trim_keep = hpage_size;
+	if (__hugetlb_opts.trim_keep) {
+		trim_keep = parse_page_size(__hugetlb_opts.trim_keep);
+		if (trim_keep < 0) {
+			WARNING("Can't parse HUGETLB_MORECORE_TRIM_KEEP: %s\n",
+				__hugetlb_opts.trim_keep);
+			trim_keep = hpage_size;
+		}
+		trim_keep = ALIGN(trim_keep, hpage_size);
+	}
+
+	/* Set first, pthread_create() may itself call malloc() */
+	trimming = 1;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, heap_trimmer, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		WARNING("Unable to start heap trim thread, shrinking the heap "
+			"directly: %s\n", strerror(ret));
+		trimming = 0;
+		return;
+	}
+
+	pthread_atfork(heap_trimmer_prepare, heap_trimmer_parent,
+		       heap_trimmer_child);
+	INFO("Trimming the heap after %lu seconds, keeping %ld bytes\n",
+	     __hugetlb_opts.trim_delay, trim_keep);
+}
+
 void hugetlbfs_setup_morecore(void)
 {
 	char *ep;
@@ -282,6 +928,8 @@ void hugetlbfs_setup_morecore(void)
 		return;
 	}
 
+	hugetlbfs_lazy_init();
+
 	/*
 	 * Determine the page size that will be used for the heap.
 	 * This can be set explicitly by setting HUGETLB_MORECORE to a valid
@@ -346,6 +994,34 @@ void hugetlbfs_setup_morecore(void)
 
 	INFO("setup_morecore(): heapaddr = 0x%lx\n", heapaddr);
 
+	if (!__hugetlb_opts.thp_morecore && __hugetlb_opts.heap_growth) {
+		growth_step = parse_page_size(__hugetlb_opts.heap_growth);
+		if (growth_step <= 0) {
+			WARNING("Can't parse HUGETLB_MORECORE_GROWTH: %s\n",
+				__hugetlb_opts.heap_growth);
+			growth_step = 0;
+		} else {
+			growth_step = ALIGN(growth_step, hpage_size);
+		}
+	}
+
+	if (!__hugetlb_opts.thp_morecore && __hugetlb_opts.heap_reserve) {
+		long reserve = parse_page_size(__hugetlb_opts.heap_reserve);
+
+		if (reserve <= 0) {
+			WARNING("Can't parse HUGETLB_MORECORE_RESERVE: %s\n",
+				__hugetlb_opts.heap_reserve);
+		} else {
+			reserve_size = reserve = ALIGN(reserve, hpage_size);
+			if (reserve_at((void *)heapaddr, reserve) == 0)
+				reserve_end = (void *)heapaddr + reserve;
+			else
+				WARNING("Unable to reserve %ld bytes for the "
+					"heap at 0x%lx: %s\n", reserve,
+					heapaddr, strerror(errno));
+		}
+	}
+
 	heaptop = heapbase = (void *)heapaddr;
 	if (__hugetlb_opts.thp_morecore)
 		__morecore = &thp_morecore;
@@ -363,4 +1039,9 @@ void hugetlbfs_setup_morecore(void)
 	 * This doesn't appear to prohibit malloc() from falling back
 	 * to mmap() if we run out of hugepages. */
 	mallopt(M_MMAP_MAX, 0);
+
+	if (__hugetlb_opts.thp_morecore && __hugetlb_opts.thp_collapse)
+		start_heap_collapser();
+	if (!__hugetlb_opts.thp_morecore && __hugetlb_opts.shrink_lazy)
+		start_heap_trimmer();
 }
@@ -0,0 +1,301 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * System policy file.  Administrators can set any HUGETLB_* variable for
+ * a set of processes selected by executable, uid or cgroup, instead of
+ * editing the environment of every service:
+ *
+ *	# Applies to every process
+ *	HUGETLB_NO_PREFAULT = yes
+ *
+ *	[match exe=/usr/sbin/mysqld]
+ *	HUGETLB_MORECORE = 2M
+ *	HUGETLB_ELFMAP = RW
+ *
+ *	[match uid=1000 cgroup=/batch.slice/job-*]
+ *	HUGETLB_MORECORE = thp
+ *
+ * All matching sections apply in file order, later ones overriding
+ * earlier ones.  A variable set in the environment always wins.
+ *
+ * This runs from the library constructor, before morecore is installed,
+ * so it must not allocate: the file is read into a static buffer with
+ * plain syscalls and the settings point into it.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "libhugetlbfs_internal.h"
+
+#define POLICY_FILE		"/etc/libhugetlbfs.conf"
+#define POLICY_MAXLEN		16384
+#define POLICY_MAX_SETTINGS	64
+
+static const char *policy_file = POLICY_FILE;
+static char policy_buf[POLICY_MAXLEN + 1];
+
+static struct policy_setting {
+	const char *name;
+	char *value;
+} policy[POLICY_MAX_SETTINGS];
+static int nr_policy;
+
+/* What rules can be matched against */
+struct policy_subject {
+	char exe[PATH_MAX + 1];
+	char cgroup[PATH_MAX + 1];
+	uid_t uid;
+};
+
+/* Shell-style matching of '*' and '?', enough for paths */
+static int glob_match(const char *pat, const char *str)
+{
+	for (; *pat; pat++, str++) {
+		if (*pat == '*') {
+			for (; *str; str++)
+				if (glob_match(pat + 1, str))
+					return 1;
+			return glob_match(pat + 1, str);
+		}
+		if (*str == '\0' || (*pat != '?' && *pat != *str))
+			return 0;
+	}
+	return *str == '\0';
+}
+
+static void read_subject(struct policy_subject *subj)
+{
+	char buf[PATH_MAX + 64];
+	char *line, *eol, *path;
+	ssize_t bytes;
+	int fd;
+
+	subj->uid = getuid();
+
+	bytes = readlink("/proc/self/exe", subj->exe, PATH_MAX);
+	subj->exe[bytes > 0 ? bytes : 0] = '\0';
+
+	/* Prefer the unified hierarchy ("0::/path"), else the first entry */
+	subj->cgroup[0] = '\0';
+	fd = open("/proc/self/cgroup", O_RDONLY);
+	if (fd < 0)
+		return;
+	bytes = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (bytes <= 0)
+		return;
+	buf[bytes] = '\0';
+
+	for (line = buf; *line; line = eol + 1) {
+		eol = strchrnul(line, '\n');
+		path = strchr(line, ':');
+		if (path)
+			path = strchr(path + 1, ':');
+		if (path && path < eol &&
+		    (!subj->cgroup[0] || !strncmp(line, "0::", 3))) {
+			path++;
+			snprintf(subj->cgroup, sizeof(subj->cgroup), "%.*s",
+				 (int)(eol - path), path);
+		}
+		if (!*eol)
+			break;
+	}
+}
+
+static char *strip(char *s)
+{
+	char *end;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+	end = s + strlen(s);
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t' ||
+			   end[-1] == '\r'))
+		*--end = '\0';
+	return s;
+}
+
+/* Does a "[match key=value ...]" header select this process? */
+static int section_matches(char *header, struct policy_subject *subj,
+			   int lineno)
+{
+	char *tok, *val, *save;
+	char *endp;
+
+	if (!strcmp(header, "default"))
+		return 1;
+	if (strncmp(header, "match ", 6)) {
+		WARNING("%s:%d: unknown section [%s]\n", policy_file, lineno,
+			header);
+		return 0;
+	}
+
+	for (tok = strtok_r(header + 6, " \t", &save); tok;
+	     tok = strtok_r(NULL, " \t", &save)) {
+		val = strchr(tok, '=');
+		if (!val) {
+			WARNING("%s:%d: expected key=value, got %s\n",
+				policy_file, lineno, tok);
+			return 0;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(tok, "exe")) {
+			if (!glob_match(val, subj->exe))
+				return 0;
+		} else if (!strcmp(tok, "cgroup")) {
+			if (!glob_match(val, subj->cgroup))
+				return 0;
+		} else if (!strcmp(tok, "uid")) {
+			if (strtoul(val, &endp, 10) != subj->uid || *endp)
+				return 0;
+		} else {
+			WARNING("%s:%d: unknown match key %s\n", policy_file,
+				lineno, tok);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void policy_set(const char *name, char *value, int lineno)
+{
+	int i;
+
+	for (i = 0; i < nr_policy; i++) {
+		if (!strcmp(policy[i].name, name)) {
+			policy[i].value = value;
+			return;
+		}
+	}
+
+	if (nr_policy >= POLICY_MAX_SETTINGS) {
+		WARNING("%s:%d: too many settings, ignoring %s\n",
+			policy_file, lineno, name);
+		return;
+	}
+	policy[nr_policy].name = name;
+	policy[nr_policy++].value = value;
+}
+
+/*
+ * Read the policy file and keep the settings of every section that
+ * matches this process.  HUGETLB_POLICY=no skips the file, and
+ * HUGETLB_POLICY=<path> reads another one; either way it must be owned
+ * by root.
+ */
+void hugetlbfs_load_policy(void)
+{
+	struct policy_subject subj;
+	char *env, *line, *eol, *eq;
+	int fd, lineno = 0, active = 1;
+	ssize_t bytes;
+	size_t len = 0;
+
+	env = getenv("HUGETLB_POLICY");
+	if (env && !strcasecmp(env, "no"))
+		return;
+	if (env && *env)
+		policy_file = env;
+
+	fd = open_trusted_file(policy_file);
+	if (fd < 0) {
+		/* Having no policy file at all is the normal case */
+		if (errno != ENOENT || strcmp(policy_file, POLICY_FILE))
+			DEBUG("Not using policy file %s\n", policy_file);
+		return;
+	}
+	while (len < POLICY_MAXLEN &&
+	       (bytes = read(fd, policy_buf + len, POLICY_MAXLEN - len)) > 0)
+		len += bytes;
+	close(fd);
+	policy_buf[len] = '\0';
+	if (len == POLICY_MAXLEN)
+		WARNING("%s is larger than %d bytes, ignoring the rest\n",
+			policy_file, POLICY_MAXLEN);
+
+	read_subject(&subj);
+
+	for (line = policy_buf; *line; line = eol + 1) {
+		eol = strchrnul(line, '\n');
+		lineno++;
+		if (*eol)
+			*eol = '\0';
+		else
+			eol--;
+
+		line = strip(line);
+		if (*line == '\0' || *line == '#')
+			continue;
+
+		if (*line == '[') {
+			char *end = strchr(line, ']');
+
+			if (!end) {
+				WARNING("%s:%d: unterminated section\n",
+					policy_file, lineno);
+				active = 0;
+				continue;
+			}
+			*end = '\0';
+			active = section_matches(strip(line + 1), &subj,
+						 lineno);
+			continue;
+		}
+
+		eq = strchr(line, '=');
+		if (!eq || strncmp(line, "HUGETLB_", 8)) {
+			WARNING("%s:%d: expected HUGETLB_<name> = <value>\n",
+				policy_file, lineno);
+			continue;
+		}
+		if (!active)
+			continue;
+		*eq = '\0';
+		policy_set(strip(line), strip(eq + 1), lineno);
+	}
+
+	if (nr_policy)
+		DEBUG("%d setting(s) from %s apply to %s\n", nr_policy,
+			policy_file, subj.exe);
+}
+
+/*
+ * Look a setting up in the environment, then in the policy file.
+ */
+char *hugetlbfs_getenv(const char *name)
+{
+	char *env = getenv(name);
+	int i;
+
+	if (env)
+		return env;
+	for (i = 0; i < nr_policy; i++)
+		if (!strcmp(policy[i].name, name))
+			return policy[i].value;
+	return NULL;
+}
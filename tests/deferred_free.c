@@ -0,0 +1,76 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_DEFERRED_FREE, a freed region keeps its huge pages until
+ * the reaper runs.  A region that needs the whole pool, allocated right
+ * after freeing another of the same size, must still succeed because
+ * get_huge_pages() flushes the queue before giving up.
+ */
+long hpage_size;
+long oc_hugepages = -1;
+
+/* Restore nr_overcommit_hugepages */
+void cleanup(void)
+{
+	if (oc_hugepages != -1)
+		set_nr_overcommit_hugepages(hpage_size, oc_hugepages);
+}
+
+int main(int argc, char *argv[])
+{
+	long nr_free;
+	size_t len;
+	void *p;
+	int i;
+
+	test_init(argc, argv);
+	hpage_size = gethugepagesize();
+	check_free_huge_pages(1);
+
+	if (!getenv("HUGETLB_DEFERRED_FREE"))
+		CONFIG("HUGETLB_DEFERRED_FREE must be set");
+
+	/* Surplus pages would hide the pages still held by the queue */
+	oc_hugepages = get_huge_page_counter(hpage_size, HUGEPAGES_OC);
+	set_nr_overcommit_hugepages(hpage_size, 0);
+
+	nr_free = get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+	len = nr_free * hpage_size;
+
+	for (i = 0; i < 3; i++) {
+		p = get_huge_pages(len, GHP_DEFAULT);
+		if (!p)
+			FAIL("get_huge_pages() of the whole pool, pass %d", i);
+		memset(p, i, len);
+		if (get_mapping_page_size(p) != hpage_size)
+			FAIL("Region is not on huge pages, pass %d", i);
+		free_huge_pages(p);
+	}
+
+	PASS();
+}
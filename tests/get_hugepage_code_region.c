@@ -0,0 +1,109 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Emit a tiny function returning 42 through the writable view of a code
+ * region and run it through the executable view.  Architectures without
+ * a snippet here only check that the two views alias.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+static const unsigned char ret42[] = {
+	0xb8, 0x2a, 0x00, 0x00, 0x00,	/* mov $42, %eax */
+	0xc3,				/* ret */
+};
+#define HAVE_RET42
+#elif defined(__aarch64__)
+static const unsigned int ret42[] = {
+	0x52800540,			/* mov w0, #42 */
+	0xd65f03c0,			/* ret */
+};
+#define HAVE_RET42
+#endif
+
+long hpage_size;
+
+int main(int argc, char *argv[])
+{
+	struct hugepage_code_region *region;
+	unsigned char *rw, *rw2;
+	void *exec, *exec2;
+
+	test_init(argc, argv);
+	hpage_size = gethugepagesize();
+	check_free_huge_pages(1);
+
+	region = get_hugepage_code_region(hpage_size, GHR_STRICT);
+	if (!region)
+		FAIL("get_hugepage_code_region(): %s", strerror(errno));
+
+	rw = hugepage_code_alloc(region, 64, 0, &exec);
+	if (!rw)
+		FAIL("hugepage_code_alloc(): %s", strerror(errno));
+	if (rw == exec)
+		FAIL("Writable and executable views are the same mapping");
+	if (get_mapping_page_size(exec) != hpage_size)
+		FAIL("Executable view is not on a hugepage");
+
+	memset(rw, 0x5a, 64);
+	if (memcmp(exec, rw, 64) != 0)
+		FAIL("Executable view does not alias the writable view");
+
+#ifdef HAVE_RET42
+	{
+		int (*fn)(void);
+
+		memcpy(rw, ret42, sizeof(ret42));
+		hugepage_code_sync(region, exec, sizeof(ret42));
+		fn = (int (*)(void))exec;
+		if (fn() != 42)
+			FAIL("Generated code returned the wrong value");
+	}
+#endif
+
+	rw2 = hugepage_code_alloc(region, 100, 256, &exec2);
+	if (!rw2 || ((unsigned long)rw2 & 255) || rw2 < rw + 64 ||
+	    (char *)exec2 - (char *)exec != rw2 - rw)
+		FAIL("Second allocation misplaced");
+
+	if (hugepage_code_alloc(region, hpage_size, 0, &exec2))
+		FAIL("Allocation beyond the end of the region succeeded");
+
+	free_hugepage_code_region(region);
+
+	/* A coloured region still holds len bytes after its offset */
+	region = get_hugepage_code_region(hpage_size / 2,
+					  GHR_STRICT|GHR_COLOR);
+	if (!region)
+		FAIL("get_hugepage_code_region(GHR_COLOR): %s",
+		     strerror(errno));
+	rw = hugepage_code_alloc(region, hpage_size / 2, 0, &exec);
+	if (!rw)
+		FAIL("Coloured region cannot hold its length: %s",
+		     strerror(errno));
+	free_hugepage_code_region(region);
+	PASS();
+}
@@ -0,0 +1,151 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_MORECORE_NONCONTIG=yes, a mapping placed where the heap
+ * would grow must not push malloc() off huge pages: the heap continues
+ * above it.  Each heap segment is a separate part of the heap file, so
+ * no two segments may map the same file offsets.
+ */
+#define NR_ALLOCS	4
+
+struct vma {
+	unsigned long start, end, offset, inode;
+	unsigned int major, minor;
+};
+
+long hpage_size;
+
+/* Find the mapping containing addr in /proc/self/maps */
+static int find_vma(void *addr, struct vma *vma)
+{
+	unsigned long a = (unsigned long)addr;
+	char line[256];
+	FILE *f;
+	int found = 0;
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		FAIL("fopen(/proc/self/maps): %s", strerror(errno));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx %*s %lx %x:%x %lu", &vma->start,
+			   &vma->end, &vma->offset, &vma->major, &vma->minor,
+			   &vma->inode) != 6)
+			continue;
+		if (a >= vma->start && a < vma->end) {
+			found = 1;
+			break;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+int main(int argc, char *argv[])
+{
+	struct vma vmas[NR_ALLOCS + 1];
+	char *p[NR_ALLOCS + 1];
+	void *blocker, *heap_end;
+	int above = 0;
+	int i, j;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_MORECORE") ||
+	    !getenv("HUGETLB_MORECORE_NONCONTIG"))
+		CONFIG("Must have HUGETLB_MORECORE=yes and "
+		       "HUGETLB_MORECORE_NONCONTIG=yes");
+
+	hpage_size = check_hugepagesize();
+	check_free_huge_pages(NR_ALLOCS + 3);
+
+	/* Take everything from the heap, never from mmap() */
+	mallopt(M_MMAP_MAX, 0);
+
+	p[0] = malloc(64);
+	if (!p[0] || !find_vma(p[0], &vmas[0]))
+		FAIL("First allocation failed");
+	if (get_mapping_page_size(p[0]) != hpage_size)
+		FAIL("Heap did not start on huge pages");
+
+	/*
+	 * Block the heap where it would grow next.  The heap may already
+	 * have been placed just below another mapping, which then does.
+	 */
+	heap_end = (void *)vmas[0].end;
+	blocker = mmap(heap_end, hpage_size, PROT_NONE,
+		       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (blocker == MAP_FAILED)
+		FAIL("mmap() blocker: %s", strerror(errno));
+	if (blocker != heap_end) {
+		munmap(blocker, hpage_size);
+		if (range_is_mapped((unsigned long)heap_end,
+				    (unsigned long)heap_end + hpage_size) != 1)
+			CONFIG("Could not place a blocker at %p", heap_end);
+		blocker = heap_end;
+	}
+	verbose_printf("Heap ends at %p, blocked\n", heap_end);
+
+	for (i = 1; i <= NR_ALLOCS; i++) {
+		p[i] = malloc(hpage_size);
+		if (!p[i])
+			FAIL("malloc() %d failed above the blocker", i);
+		memset(p[i], i, hpage_size);
+		if (get_mapping_page_size(p[i]) != hpage_size ||
+		    get_mapping_page_size(p[i] + hpage_size - 1) != hpage_size)
+			FAIL("Allocation %d at %p is not on huge pages", i,
+			     p[i]);
+		if ((void *)p[i] > blocker)
+			above = 1;
+		if (!find_vma(p[i], &vmas[i]))
+			FAIL("No mapping for allocation %d", i);
+		verbose_printf("Allocation %d at %p, offset 0x%lx\n", i, p[i],
+			       vmas[i].offset);
+	}
+	if (!above)
+		FAIL("The heap did not continue above the blocker");
+
+	/* Segments of one heap file must not share file offsets */
+	for (i = 0; i <= NR_ALLOCS; i++) {
+		for (j = 0; j < i; j++) {
+			struct vma *a = &vmas[i], *b = &vmas[j];
+
+			if (a->start == b->start || a->inode != b->inode ||
+			    a->major != b->major || a->minor != b->minor)
+				continue;
+			if (a->offset < b->offset + (b->end - b->start) &&
+			    b->offset < a->offset + (a->end - a->start))
+				FAIL("Heap segments at 0x%lx and 0x%lx overlap "
+				     "in the heap file", a->start, b->start);
+		}
+	}
+
+	PASS();
+}
@@ -0,0 +1,116 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * With HUGETLB_MORECORE_FALLBACK=thp, malloc() must keep succeeding once
+ * the huge page pool is exhausted.  The heap stays contiguous, starting
+ * on huge pages and continuing on ordinary (THP) pages.
+ */
+#define POOL_PAGES	3
+#define NR_ALLOCS	(POOL_PAGES + 3)
+
+long hpage_size;
+long oc_hugepages = -1;
+
+/* Restore nr_overcommit_hugepages */
+void cleanup(void)
+{
+	if (oc_hugepages != -1)
+		set_nr_overcommit_hugepages(hpage_size, oc_hugepages);
+}
+
+int main(int argc, char *argv[])
+{
+	char *p[NR_ALLOCS];
+	long nr_free, stride = 0;
+	void *hold = NULL;
+	size_t hold_len = 0;
+	int nr_huge = 0;
+	int i;
+
+	test_init(argc, argv);
+
+	if (!getenv("HUGETLB_MORECORE") ||
+	    !getenv("HUGETLB_MORECORE_FALLBACK"))
+		CONFIG("Must have HUGETLB_MORECORE=yes and "
+		       "HUGETLB_MORECORE_FALLBACK=thp");
+
+	hpage_size = check_hugepagesize();
+	check_must_be_root();
+	check_free_huge_pages(POOL_PAGES);
+
+	oc_hugepages = get_huge_page_counter(hpage_size, HUGEPAGES_OC);
+	set_nr_overcommit_hugepages(hpage_size, 0);
+
+	/* Leave the heap only a few pages of the pool */
+	nr_free = get_huge_page_counter(hpage_size, HUGEPAGES_FREE);
+	if (nr_free > POOL_PAGES) {
+		hold_len = (nr_free - POOL_PAGES) * hpage_size;
+		hold = get_huge_pages(hold_len, GHP_DEFAULT);
+		if (!hold)
+			FAIL("Could not take %ld pages from the pool",
+			     nr_free - POOL_PAGES);
+	}
+
+	/* Take everything from the heap, never from mmap() */
+	mallopt(M_MMAP_MAX, 0);
+
+	for (i = 0; i < NR_ALLOCS; i++) {
+		p[i] = malloc(hpage_size);
+		if (!p[i])
+			FAIL("malloc() %d failed beyond the pool", i);
+		memset(p[i], i, hpage_size);
+
+		if (i == 1)
+			stride = p[1] - p[0];
+		else if (i > 1 && p[i] - p[i - 1] != stride)
+			FAIL("Heap is not contiguous: %p follows %p", p[i],
+			     p[i - 1]);
+
+		if (get_mapping_page_size(p[i]) == hpage_size) {
+			if (nr_huge != i)
+				FAIL("Allocation %d at %p is on huge pages "
+				     "after one that was not", i, p[i]);
+			nr_huge++;
+		}
+		verbose_printf("Allocation %d at %p%s\n", i, p[i],
+			       nr_huge == i + 1 ? " on huge pages" : "");
+	}
+
+	if (!nr_huge)
+		FAIL("Heap did not start on huge pages");
+	if (get_mapping_page_size(p[NR_ALLOCS - 1] + hpage_size - 1) ==
+	    hpage_size)
+		FAIL("Heap stayed on huge pages beyond the pool");
+
+	if (hold)
+		free_huge_pages(hold);
+	PASS();
+}
@@ -0,0 +1,128 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Regions from get_huge_pages() with GHP_DONTFORK must be absent in a
+ * child, those with GHP_WIPEONFORK zero-filled, and those with
+ * GHP_DONTDUMP marked to be left out of core dumps.  The parent's copies
+ * must be untouched by the fork.
+ */
+long hpage_size;
+
+/* Does the smaps entry for addr list flag in VmFlags? */
+static int has_vmflag(void *addr, const char *flag)
+{
+	unsigned long start, end;
+	char line[256];
+	int found = 0, in_vma = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f)
+		FAIL("fopen(/proc/self/smaps): %s", strerror(errno));
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+			in_vma = (unsigned long)addr >= start &&
+				 (unsigned long)addr < end;
+		else if (in_vma && !strncmp(line, "VmFlags:", 8)) {
+			found = strstr(line, flag) != NULL;
+			break;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+static void *get_region(ghp_t flags)
+{
+	void *p = get_huge_pages(hpage_size, GHP_DEFAULT|flags);
+
+	if (!p)
+		FAIL("get_huge_pages(0x%lx)", flags);
+	memset(p, 0xaa, hpage_size);
+	return p;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char vec;
+	char *dontfork, *wipe, *dontdump;
+	int status;
+	pid_t pid;
+
+	test_init(argc, argv);
+	hpage_size = gethugepagesize();
+	check_free_huge_pages(3);
+
+	dontfork = get_region(GHP_DONTFORK);
+	wipe = get_region(GHP_WIPEONFORK);
+	dontdump = get_region(GHP_DONTDUMP);
+
+	if (!has_vmflag(dontdump, " dd"))
+		FAIL("GHP_DONTDUMP region is not excluded from core dumps");
+
+	pid = fork();
+	if (pid < 0)
+		FAIL("fork(): %s", strerror(errno));
+	if (pid == 0) {
+		if (mincore(dontfork, getpagesize(), &vec) == 0 ||
+		    errno != ENOMEM)
+			_exit(1);
+		if (wipe[0] != 0 || wipe[hpage_size - 1] != 0)
+			_exit(2);
+		if ((unsigned char)dontdump[0] != 0xaa)
+			_exit(3);
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		FAIL("waitpid(): %s", strerror(errno));
+	if (!WIFEXITED(status))
+		FAIL("Child terminated abnormally");
+	switch (WEXITSTATUS(status)) {
+	case 0:
+		break;
+	case 1:
+		FAIL("GHP_DONTFORK region is mapped in the child");
+	case 2:
+		FAIL("GHP_WIPEONFORK region is not zero in the child");
+	default:
+		FAIL("Child saw wrong contents in an ordinary region");
+	}
+
+	if ((unsigned char)dontfork[0] != 0xaa ||
+	    (unsigned char)wipe[hpage_size - 1] != 0xaa)
+		FAIL("Parent's regions changed across fork()");
+
+	free_huge_pages(dontfork);
+	free_huge_pages(wipe);
+	free_huge_pages(dontdump);
+	PASS();
+}
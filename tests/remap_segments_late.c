@@ -0,0 +1,110 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Remap the text segment with hugetlbfs_remap_segments() while another
+ * thread keeps running code and reading constants from it, and check
+ * that the thread never notices and the text ends up on huge pages.
+ */
+#define BLOCK_SIZE	16384
+#define CONST		0xdeadbeef
+
+const int big_const[BLOCK_SIZE] = {
+	[0] = CONST, [17] = CONST, [BLOCK_SIZE-1] = CONST,
+};
+
+static volatile int stop;
+static volatile unsigned long iterations;
+
+static int __attribute__ ((noinline)) sum_const(void)
+{
+	return big_const[0] + big_const[17] + big_const[BLOCK_SIZE-1];
+}
+
+static void *spin(void *arg)
+{
+	while (!stop) {
+		if (sum_const() != (int)(3 * CONST)) {
+			stop = 2;
+			break;
+		}
+		iterations++;
+	}
+	return NULL;
+}
+
+static void __attribute__ ((noinline)) *get_pc(void)
+{
+	return __builtin_return_address(0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long before;
+	pthread_t thread;
+	void *pc;
+	int ret;
+
+	test_init(argc, argv);
+
+	pc = get_pc();
+	if (test_addr_huge(pc) == 1)
+		CONFIG("Text is already on huge pages, unset HUGETLB_ELFMAP");
+
+	if (pthread_create(&thread, NULL, spin, NULL))
+		FAIL("pthread_create: %s", strerror(errno));
+	while (!iterations)
+		;
+
+	ret = hugetlbfs_remap_segments("R");
+	if (ret < 0 && errno == ENOENT)
+		CONFIG("No segments suitable for remapping; not linked "
+		       "with --hugetlbfs-align?");
+	if (ret < 0)
+		FAIL("hugetlbfs_remap_segments: %s", strerror(errno));
+
+	before = iterations;
+	while (iterations == before && stop != 2)
+		;
+	stop = 1;
+	pthread_join(thread, NULL);
+	if (stop == 2)
+		FAIL("Other thread read the wrong constants during the remap");
+
+	pc = get_pc();
+	if (test_addr_huge(pc) != 1)
+		FAIL("Text at %p is not on huge pages", pc);
+	if (test_addr_huge((void *)&big_const[BLOCK_SIZE/2]) != 1)
+		FAIL("Constants are not on huge pages");
+	if (sum_const() != (int)(3 * CONST))
+		FAIL("Constants changed by the remap");
+
+	if (hugetlbfs_remap_segments("R") == 0 || errno != EALREADY)
+		FAIL("Second remap did not fail with EALREADY");
+
+	PASS();
+}
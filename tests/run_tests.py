@@ -565,6 +565,8 @@ def functional_tests():
             HUGETLB_RESTRICT_EXE="unknown:none")
     do_test("malloc", LD_PRELOAD="libhugetlbfs.so", HUGETLB_MORECORE="yes",
             HUGETLB_RESTRICT_EXE="unknown:malloc")
+    do_test("malloc", LD_PRELOAD="libhugetlbfs.so", HUGETLB_MORECORE="thp",
+            HUGETLB_MORECORE_COLLAPSE="yes")
     do_test("malloc_manysmall")
     do_test("malloc_manysmall", LD_PRELOAD="libhugetlbfs.so",
             HUGETLB_MORECORE="yes")
@@ -577,7 +579,34 @@ def functional_tests():
             HUGETLB_MORECORE_SHRINK="yes")
     do_test("heapshrink", LD_PRELOAD="libhugetlbfs.so libheapshrink.so",
             HUGETLB_MORECORE="yes", HUGETLB_MORECORE_SHRINK="yes")
+    do_test("heapshrink", LD_PRELOAD="libhugetlbfs.so libheapshrink.so",
+            HUGETLB_MORECORE="yes", HUGETLB_MORECORE_SHRINK="lazy",
+            HUGETLB_MORECORE_TRIM_DELAY="1")
     do_test("heap-overflow", HUGETLB_VERBOSE="1", HUGETLB_MORECORE="yes")
+    do_test("heap_noncontig", HUGETLB_MORECORE="yes",
+            HUGETLB_MORECORE_NONCONTIG="yes")
+    do_test("heap_thp_fallback", HUGETLB_MORECORE="yes",
+            HUGETLB_MORECORE_FALLBACK="thp")
+
+    # Geometric heap growth and a reserved heap range
+    do_test("malloc", LD_PRELOAD="libhugetlbfs.so", HUGETLB_MORECORE="yes",
+            HUGETLB_MORECORE_GROWTH="32M")
+    do_test("malloc_manysmall", LD_PRELOAD="libhugetlbfs.so",
+            HUGETLB_MORECORE="yes", HUGETLB_MORECORE_GROWTH="32M")
+    do_test("heapshrink", LD_PRELOAD="libhugetlbfs.so", HUGETLB_MORECORE="yes",
+            HUGETLB_MORECORE_GROWTH="32M")
+    do_test("heapshrink", LD_PRELOAD="libhugetlbfs.so libheapshrink.so",
+            HUGETLB_MORECORE="yes", HUGETLB_MORECORE_SHRINK="yes",
+            HUGETLB_MORECORE_GROWTH="32M")
+    do_test("malloc", LD_PRELOAD="libhugetlbfs.so", HUGETLB_MORECORE="yes",
+            HUGETLB_MORECORE_RESERVE="1G")
+    do_test("malloc_manysmall", LD_PRELOAD="libhugetlbfs.so",
+            HUGETLB_MORECORE="yes", HUGETLB_MORECORE_RESERVE="1G")
+    do_test("heapshrink", LD_PRELOAD="libhugetlbfs.so", HUGETLB_MORECORE="yes",
+            HUGETLB_MORECORE_RESERVE="1G")
+    do_test("heapshrink", LD_PRELOAD="libhugetlbfs.so libheapshrink.so",
+            HUGETLB_MORECORE="yes", HUGETLB_MORECORE_SHRINK="yes",
+            HUGETLB_MORECORE_RESERVE="1G")
 
     # Run the remapping tests' up-front checks
     linkhuge_wordsizes = check_linkhuge_tests()
@@ -595,6 +624,7 @@ def functional_tests():
     elflink_rw_test("linkhuge_rw")
     # elflink_rw sharing tests
     elflink_rw_and_share_test("linkhuge_rw")
+    do_test("remap_segments_late")
 
     # Accounting bug tests
     # reset free hpages because sharing will have held some
@@ -607,6 +637,10 @@ def functional_tests():
 
     # Test direct allocation API
     do_test("get_huge_pages")
+    do_test("get_hugepage_code_region")
+    do_test("stream_copy")
+    do_test("region_hints")
+    do_test("deferred_free", HUGETLB_DEFERRED_FREE="60000")
 
     # Test overriding of shmget()
     do_shm_test("shmoverride_linked")
@@ -0,0 +1,128 @@
+/*
+ * libhugetlbfs - Easy use of Linux hugepages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hugetlbfs.h>
+
+#include "hugetests.h"
+
+/*
+ * Check hugetlbfs_stream_copy() against memcpy() for every combination
+ * of small misalignments and lengths around the cache line size.
+ *
+ * Given a size in MB, instead compare the two as a benchmark: the time
+ * to copy, and the time to read a small "hot" buffer afterwards, which
+ * shows how much of the cache the copy evicted.
+ *
+ *	stream_copy 1024
+ */
+#define BUFSZ	8192
+#define HOTSZ	(512 * 1024)
+
+static volatile unsigned long sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, void (*copy)(void *, const void *, size_t),
+		  char *dst, const char *src, size_t len, const char *hot)
+{
+	double t0, t1, t2;
+	unsigned long sum = 0;
+	size_t i;
+
+	/* Warm the hot buffer */
+	for (i = 0; i < HOTSZ; i += 64)
+		sum += hot[i];
+
+	t0 = now();
+	copy(dst, src, len);
+	t1 = now();
+	for (i = 0; i < HOTSZ; i += 64)
+		sum += hot[i];
+	t2 = now();
+	sink = sum;
+
+	printf("%-8s copy %8.2f GB/s   hot re-read %8.1f us\n", name,
+	       len / (t1 - t0) / 1e9, (t2 - t1) * 1e6);
+}
+
+static void plain_copy(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+static void run_bench(size_t mb)
+{
+	size_t len = mb << 20;
+	char *src, *dst, *hot;
+	int i;
+
+	src = malloc(len);
+	dst = malloc(len);
+	hot = malloc(HOTSZ);
+	if (!src || !dst || !hot)
+		CONFIG("Can't allocate %zu MB buffers", mb);
+	memset(src, 1, len);
+	memset(dst, 2, len);
+	memset(hot, 3, HOTSZ);
+
+	for (i = 0; i < 3; i++) {
+		bench("memcpy", plain_copy, dst, src, len, hot);
+		bench("stream", hugetlbfs_stream_copy, dst, src, len, hot);
+	}
+	exit(RC_PASS);
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char src[BUFSZ], dst[BUFSZ], ref[BUFSZ];
+	int soff, doff, i;
+	size_t len;
+
+	test_init(argc, argv);
+	if (argc > 1)
+		run_bench(strtoul(argv[1], NULL, 0));
+
+	for (i = 0; i < BUFSZ; i++)
+		src[i] = random();
+
+	for (soff = 0; soff < 64; soff += 7)
+		for (doff = 0; doff < 64; doff += 5)
+			for (len = 0; len < BUFSZ - 128; len += len < 300 ? 1 : 997) {
+				memset(dst, 0xaa, BUFSZ);
+				memset(ref, 0xaa, BUFSZ);
+				hugetlbfs_stream_copy(dst + doff, src + soff, len);
+				memcpy(ref + doff, src + soff, len);
+				if (memcmp(dst, ref, BUFSZ))
+					FAIL("Mismatch copying %zu bytes from "
+					     "offset %d to offset %d", len,
+					     soff, doff);
+			}
+
+	PASS();
+}
@@ -0,0 +1,2 @@
+// commit<a3e95a7d76dd7b423622aed8141aae174a0fec28>
+#define VERSION "commit<a3e95a7d76dd7b423622aed8141aae174a0fec28>"